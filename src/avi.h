@@ -0,0 +1,149 @@
+#pragma once
+
+#include <avr/pgmspace.h>
+#include <Arduino.h>
+
+/*
+ * AVI: native binary image of one target memory. A little-endian header is
+ * followed by a page-aligned payload of exactly header.length bytes, so pages
+ * can be streamed from the file straight into the target. With AVI_FLAG_LZ in
+ * flags the payload is LZ compressed (see below), length and crc are those of
+ * the decompressed payload.
+ */
+
+enum avimemory_t : uint8_t { AVI_FLASH, AVI_EEPROM };
+
+constexpr uint8_t AVI_VERSION = 1;
+constexpr uint16_t AVI_FLAG_LZ = 0x0001;
+
+static const char AVI_MAGIC[3] PROGMEM = { 'A', 'V', 'I' };
+
+struct aviheader_t {
+  char magic[3]; // "AVI"
+  uint8_t version;
+  uint8_t signature[3];
+  avimemory_t memory;
+  uint32_t base; // Byte address of the first payload byte, page-aligned
+  uint32_t length; // Payload length in bytes, a multiple of pageSize
+  uint16_t pageSize;
+  uint16_t flags;
+  uint32_t crc; // CRC32 (IEEE 802.3) of the payload
+};
+
+constexpr uint32_t CRC32_INIT = 0xFFFFFFFF; // The final CRC is ~crc32Update(CRC32_INIT, ...)
+
+static const uint32_t CRC32_TABLE[16] PROGMEM = {
+  0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+  0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+static uint32_t crc32Update(uint32_t crc, const uint8_t *data, uint16_t size) {
+  while (size--) {
+    crc = (crc >> 4) ^ pgm_read_dword(&CRC32_TABLE[(crc ^ *data) & 0x0F]);
+    crc = (crc >> 4) ^ pgm_read_dword(&CRC32_TABLE[(crc ^ (*data >> 4)) & 0x0F]);
+    ++data;
+  }
+  return crc;
+}
+
+static void aviInitHeader(aviheader_t &header, const uint8_t *signature, avimemory_t memory, uint32_t base, uint32_t length, uint16_t pageSize) {
+  memcpy_P(header.magic, AVI_MAGIC, sizeof(header.magic));
+  header.version = AVI_VERSION;
+  memcpy(header.signature, signature, sizeof(header.signature));
+  header.memory = memory;
+  header.base = base;
+  header.length = length;
+  header.pageSize = pageSize;
+  header.flags = 0;
+  header.crc = 0;
+}
+
+static bool aviCheckHeader(const aviheader_t &header, const uint8_t *signature, avimemory_t memory, uint16_t pageSize, uint32_t size) {
+  return (! memcmp_P(header.magic, AVI_MAGIC, sizeof(header.magic))) && (header.version == AVI_VERSION) &&
+    (! memcmp(header.signature, signature, sizeof(header.signature))) && (header.memory == memory) &&
+    (header.pageSize == pageSize) && (! (header.base % pageSize)) && (! (header.length % pageSize)) &&
+    (header.base + header.length <= size);
+}
+
+/*
+ * AVI cache of a HEX file, built by the programmer. The header covers the
+ * present pages (base 0) and its crc is that of what follows it up to the
+ * payload: the key below, the present page bitmap of pages / 8 bytes and a
+ * CRC32 per present page. The present pages follow in address order.
+ */
+struct avicache_t {
+  uint32_t sourceSize; // HEX file the cache was built from
+  uint32_t sourceCrc; // CRC32 of its text
+  uint16_t pages; // Bits in the bitmap
+  uint16_t present; // Pages in the payload
+};
+
+static inline uint32_t aviCacheTable(const avicache_t &cache) {
+  return sizeof(aviheader_t) + sizeof(avicache_t) + cache.pages / 8;
+}
+
+static inline uint32_t aviCachePayload(const avicache_t &cache) {
+  return aviCacheTable(cache) + cache.present * sizeof(uint32_t);
+}
+
+/*
+ * AVI_FLAG_LZ payload: LZSS over a window of the last AVI_LZ_WINDOW bytes out,
+ * all the RAM a decoder needs. A flag byte tells, least significant bit
+ * first, if each of the next 8 items is a literal byte (0) or a match (1).
+ * A match is the distance back minus 1 and the length minus AVI_LZ_MIN_MATCH,
+ * a byte each, and may overlap the bytes it produces.
+ */
+constexpr uint16_t AVI_LZ_WINDOW = 256; // The ring index wraps as an uint8_t
+constexpr uint8_t AVI_LZ_MIN_MATCH = 3;
+
+struct avilz_t {
+  uint8_t window[AVI_LZ_WINDOW]; // Ring of the last bytes out
+  uint8_t pos; // Next byte of window
+  uint8_t flags; // Of the items left
+  uint8_t items; // Left in flags
+  uint8_t distance; // Minus 1, of the match being copied
+  uint16_t match; // Bytes left in it
+};
+
+typedef int16_t (*avigetc_t)(); // Next payload byte, -1 at the end
+
+static void aviLzBegin(avilz_t &lz) {
+  lz.pos = 0;
+  lz.items = 0;
+  lz.match = 0;
+}
+
+static bool aviLzRead(avilz_t &lz, uint8_t *data, uint16_t size, avigetc_t getc) { // False on a truncated payload
+  while (size--) {
+    if (! lz.match) {
+      int16_t c;
+
+      if (! lz.items) {
+        if ((c = getc()) < 0)
+          return false;
+        lz.flags = c;
+        lz.items = 8;
+      }
+      --lz.items;
+      c = getc();
+      if (c < 0)
+        return false;
+      if (lz.flags & 0x01) {
+        lz.distance = c;
+        if ((c = getc()) < 0)
+          return false;
+        lz.match = c + AVI_LZ_MIN_MATCH;
+      } else {
+        lz.window[lz.pos++] = c;
+        *data++ = c;
+      }
+      lz.flags >>= 1;
+      if (! lz.match)
+        continue;
+    }
+    lz.window[lz.pos] = lz.window[(uint8_t)(lz.pos - lz.distance - 1)];
+    *data++ = lz.window[lz.pos++];
+    --lz.match;
+  }
+  return true;
+}
@@ -12,15 +12,129 @@
 #define ISP_DI      PC1
 #define ISP_SCK     PC2
 
-constexpr uint16_t EEPROM_SIZE = 1024;
-constexpr uint8_t EEPROM_PAGE_SIZE = 4;
-constexpr uint16_t FLASH_SIZE = 32768;
-constexpr uint8_t FLASH_PAGE_SIZE = 64;
+/*
+ * Gang mode (build with -DISP_GANG=2..4): RST, DO and SCK are wired to all
+ * targets, each slot has its own DI line sampled in the same SCK phase:
+ *
+ *   Slot  DI
+ *   0     PC1 (ISP_DI)
+ *   1     PC4
+ *   2     PC5
+ *   3     PD2
+ *
+ * Commands are broadcast. Sync, signature, RDY/BSY and read-back results are
+ * checked per slot and a failing slot is dropped from ispSlots, so the run
+ * goes on for the others. Reads used for decisions return the first slot
+ * still in the run.
+ */
+#ifdef ISP_GANG
+#define ISP_DI1     PC4
+#define ISP_DI2     PC5
+#define ISP_DI3_DDR   DDRD
+#define ISP_DI3_PORT  PORTD
+#define ISP_DI3_PIN   PIND
+#define ISP_DI3     PD2
+
+constexpr uint8_t ISP_SLOTS = ISP_GANG;
+
+static_assert((ISP_GANG >= 2) && (ISP_GANG <= 4), "ISP_GANG must be 2..4");
+#else
+constexpr uint8_t ISP_SLOTS = 1;
+#endif
+
+constexpr uint8_t ISP_ALL_SLOTS = (1 << ISP_SLOTS) - 1;
+
+enum ispfuse_t : uint8_t { ISP_FUSE_LOCK, ISP_FUSE_LOW, ISP_FUSE_HIGH, ISP_FUSE_EXT, ISP_FUSE_NONE };
+
+constexpr uint8_t ISP_FUSES = ISP_FUSE_NONE;
+
+enum ispwait_t : uint8_t { ISP_WAIT_ERASE, ISP_WAIT_FLASH, ISP_WAIT_EEPROM, ISP_WAIT_EEPROM_PAGE };
+
+constexpr uint8_t ISP_WAITS = ISP_WAIT_EEPROM_PAGE + 1;
+
+/*
+ * Target geometry and timing, looked up by signature with ispFindDevice().
+ * Boot sections are decoded from BOOTSZ1:0 and BOOTRST in bits 2:0 of
+ * bootFuse: BOOTSZ = 11 selects bootSize words, each step down doubles it.
+ * Write delays are tWD in 0.1 ms, so the same number in ms is a 10 times
+ * margin for the RDY/BSY timeout. fuseMask has the implemented fuse bits,
+ * the others are written as 1 and ignored on verify.
+ */
+struct ispdevice_t {
+  uint8_t signature[3];
+  uint8_t flashPageSize; // Words
+  uint16_t flashPages;
+  uint16_t eepromSize;
+  uint8_t eepromPageSize;
+  ispfuse_t bootFuse; // ISP_FUSE_NONE without boot section
+  uint16_t bootSize; // Words
+  uint8_t wait[ISP_WAITS]; // tWD in 0.1 ms
+  uint8_t fuseMask[ISP_FUSES];
+  PGM_P name;
+};
+
+static const char ISP_ATMEGA88_NAME[] PROGMEM = "ATmega88";
+static const char ISP_ATMEGA168_NAME[] PROGMEM = "ATmega168";
+static const char ISP_ATMEGA328_NAME[] PROGMEM = "ATmega328";
+static const char ISP_ATMEGA328P_NAME[] PROGMEM = "ATmega328P";
+static const char ISP_ATMEGA32U4_NAME[] PROGMEM = "ATmega32U4";
+static const char ISP_ATMEGA1280_NAME[] PROGMEM = "ATmega1280";
+static const char ISP_ATMEGA2560_NAME[] PROGMEM = "ATmega2560";
+static const char ISP_ATTINY85_NAME[] PROGMEM = "ATtiny85";
+
+static const ispdevice_t ISP_DEVICES[] PROGMEM = {
+  { { 0x1E, 0x95, 0x0F }, 64, 256, 1024, 4, ISP_FUSE_HIGH, 256, { 90, 45, 36, 36 }, { 0x3F, 0xFF, 0xFF, 0x07 }, ISP_ATMEGA328P_NAME },
+  { { 0x1E, 0x95, 0x14 }, 64, 256, 1024, 4, ISP_FUSE_HIGH, 256, { 90, 45, 36, 36 }, { 0x3F, 0xFF, 0xFF, 0x07 }, ISP_ATMEGA328_NAME },
+  { { 0x1E, 0x94, 0x0B }, 64, 128, 512, 4, ISP_FUSE_EXT, 128, { 90, 45, 36, 36 }, { 0x3F, 0xFF, 0xFF, 0x07 }, ISP_ATMEGA168_NAME }, // 168PA
+  { { 0x1E, 0x94, 0x06 }, 64, 128, 512, 4, ISP_FUSE_EXT, 128, { 90, 45, 36, 36 }, { 0x3F, 0xFF, 0xFF, 0x07 }, ISP_ATMEGA168_NAME }, // 168(A)
+  { { 0x1E, 0x93, 0x0F }, 32, 128, 512, 4, ISP_FUSE_EXT, 128, { 90, 45, 36, 36 }, { 0x3F, 0xFF, 0xFF, 0x07 }, ISP_ATMEGA88_NAME }, // 88PA
+  { { 0x1E, 0x93, 0x0A }, 32, 128, 512, 4, ISP_FUSE_EXT, 128, { 90, 45, 36, 36 }, { 0x3F, 0xFF, 0xFF, 0x07 }, ISP_ATMEGA88_NAME }, // 88(A)
+  { { 0x1E, 0x95, 0x87 }, 64, 256, 1024, 4, ISP_FUSE_HIGH, 256, { 90, 45, 90, 90 }, { 0x3F, 0xFF, 0xFF, 0x0F }, ISP_ATMEGA32U4_NAME },
+  { { 0x1E, 0x97, 0x03 }, 128, 512, 4096, 8, ISP_FUSE_HIGH, 512, { 90, 45, 90, 90 }, { 0x3F, 0xFF, 0xFF, 0x07 }, ISP_ATMEGA1280_NAME },
+  { { 0x1E, 0x98, 0x01 }, 128, 1024, 4096, 8, ISP_FUSE_HIGH, 512, { 90, 45, 90, 90 }, { 0x3F, 0xFF, 0xFF, 0x07 }, ISP_ATMEGA2560_NAME },
+  { { 0x1E, 0x93, 0x0B }, 32, 128, 512, 4, ISP_FUSE_NONE, 0, { 90, 45, 40, 40 }, { 0x03, 0xFF, 0xFF, 0x01 }, ISP_ATTINY85_NAME }
+};
+
+constexpr uint8_t FLASH_PAGE_SIZE_MAX = 128; // Words, largest flashPageSize in ISP_DEVICES
+constexpr uint16_t FLASH_PAGES_MAX = 1024;
+constexpr uint8_t EEPROM_PAGE_SIZE_MAX = 8;
+
+static ispdevice_t ispDevice;
+
+static bool ispFindDevice(const uint8_t *sign) {
+  for (uint8_t i = 0; i < sizeof(ISP_DEVICES) / sizeof(ISP_DEVICES[0]); ++i) {
+    if (! memcmp_P(sign, ISP_DEVICES[i].signature, sizeof(ispDevice.signature))) {
+      memcpy_P(&ispDevice, &ISP_DEVICES[i], sizeof(ispDevice));
+      return true;
+    }
+  }
+  return false;
+}
+
+static inline uint16_t ispFlashPageBytes() {
+  return ispDevice.flashPageSize * 2;
+}
+
+static inline uint32_t ispFlashSize() {
+  return (uint32_t)ispDevice.flashPages * ispFlashPageBytes();
+}
+
+static uint8_t ispSlots; // Slots still in the run, all of them after ispInit()
+static uint8_t ispLead; // First of ispSlots
+static uint8_t ispIn[ISP_SLOTS]; // Last byte received from each slot
 
 static void ispInit() {
   ISP_DDR |= (1 << ISP_RST) | (1 << ISP_DO) | (1 << ISP_SCK); // RST, DO and SCK as OUTPUT
   ISP_DDR &= ~(1 << ISP_DI); // DI as INPUT
   ISP_PORT &= ~((1 << ISP_RST) | (1 << ISP_SCK) | (1 << ISP_DI)); // RST = LOW, SCK = LOW, DI pullup disabled
+#ifdef ISP_GANG
+  ISP_DDR &= ~((1 << ISP_DI1) | (1 << ISP_DI2));
+  ISP_PORT &= ~((1 << ISP_DI1) | (1 << ISP_DI2));
+  ISP_DI3_DDR &= ~(1 << ISP_DI3);
+  ISP_DI3_PORT &= ~(1 << ISP_DI3);
+#endif
+  ispSlots = ISP_ALL_SLOTS;
+  ispLead = 0;
 }
 
 static void ispDone() {
@@ -28,49 +142,270 @@ static void ispDone() {
   ISP_DDR &= ~((1 << ISP_RST) | (1 << ISP_DI) | (1 << ISP_DO) | (1 << ISP_SCK)); // RST, DI, DO and SCK as INTPUT
 }
 
+static void ispDrop(uint8_t slots) {
+  ispSlots &= ~slots;
+  for (ispLead = 0; (ispLead < ISP_SLOTS - 1) && (! (ispSlots & (1 << ispLead))); ++ispLead);
+}
+
+static uint8_t ispSlotCount(uint8_t slots) {
+  uint8_t result = 0;
+
+  for (; slots; slots >>= 1) {
+    result += slots & 0x01;
+  }
+  return result;
+}
+
+static uint8_t ispMismatch(uint8_t expected, uint8_t mask = 0xFF) { // Slots whose last byte differs in mask bits
+  uint8_t result = 0;
+
+  for (uint8_t slot = 0; slot < ISP_SLOTS; ++slot) {
+    if ((ispSlots & (1 << slot)) && ((ispIn[slot] ^ expected) & mask))
+      result |= 1 << slot;
+  }
+  return result;
+}
+
+static bool ispMatch(uint8_t expected, uint8_t mask = 0xFF) { // Drops mismatching slots, false if none is left
+  ispDrop(ispMismatch(expected, mask));
+  return ispSlots;
+}
+
 static void ispReset() {
   ISP_PORT |= (1 << ISP_RST);
   delay(1);
   ISP_PORT &= ~(1 << ISP_RST);
 }
 
+/*
+ * Clock settings are named after the slowest target clock they are legal for:
+ * each SCK phase must last more than 2 target clocks (3 for fck >= 12 MHz).
+ * The kernel itself needs 5 programmer cycles of high and 7 cycles of low
+ * phase, so padding is only added when 2 target clocks + 1 cycle is longer.
+ *
+ * Programmer at F_CPU = 16 MHz:
+ *
+ *   Setting           Target   High  Low  Cycles/bit  SCK
+ *   ISP_CLOCK_8MHZ    8 MHz    5     7    12          1333 kHz
+ *   ISP_CLOCK_4MHZ    4 MHz    9     9    18           889 kHz
+ *   ISP_CLOCK_2MHZ    2 MHz    17    17   34           471 kHz
+ *   ISP_CLOCK_1MHZ    1 MHz    33    33   66           242 kHz
+ *   ISP_CLOCK_128KHZ  128 kHz  251   251  502          31.9 kHz
+ *
+ * ISP_CLOCK_8MHZ is the kernel floor, so 16 MHz targets run at it too (fclk/4
+ * would be 4 MHz, out of reach of a bit-banged port). Below it every setting
+ * is just under fclk/4 of its target. A byte costs 8 times the cycles/bit plus
+ * call overhead; interrupts may only stretch a phase, never shorten it.
+ */
+enum ispclock_t : uint8_t { ISP_CLOCK_8MHZ, ISP_CLOCK_4MHZ, ISP_CLOCK_2MHZ, ISP_CLOCK_1MHZ, ISP_CLOCK_128KHZ };
+
+#ifndef ISP_CLOCK
+#define ISP_CLOCK ISP_CLOCK_8MHZ
+#endif
+
+constexpr uint32_t ispTargetClock(ispclock_t clock) {
+  return clock == ISP_CLOCK_8MHZ ? 8000000 : clock == ISP_CLOCK_4MHZ ? 4000000 : clock == ISP_CLOCK_2MHZ ? 2000000 : clock == ISP_CLOCK_1MHZ ? 1000000 : 128000;
+}
+
+constexpr uint16_t ispPhaseCycles(ispclock_t clock) {
+  return F_CPU * 2 / ispTargetClock(clock) + 1;
+}
+
+constexpr uint16_t ispPadCycles(ispclock_t clock, uint8_t kernel) {
+  return ispPhaseCycles(clock) > kernel ? ispPhaseCycles(clock) - kernel : 0;
+}
+
+#ifdef ISP_GANG
+constexpr uint8_t ISP_KERNEL_HIGH = 2; // Lower bounds for the compiled gang kernel
+constexpr uint8_t ISP_KERNEL_LOW = 4;
+#else
+constexpr uint8_t ISP_KERNEL_HIGH = 5;
+constexpr uint8_t ISP_KERNEL_LOW = 7;
+#endif
+
+constexpr uint16_t ispBitCycles(ispclock_t clock) {
+  return ISP_KERNEL_HIGH + ISP_KERNEL_LOW + ispPadCycles(clock, ISP_KERNEL_HIGH) + ispPadCycles(clock, ISP_KERNEL_LOW);
+}
+
+#if defined(ISP_HOST)
+/*
+ * Host build for tools/stktest: bytes go to the target model of the test
+ * instead of the port.
+ */
+uint8_t ispHostTransfer(uint8_t data);
+
+template <ispclock_t CLOCK>
 static uint8_t ispTransfer(uint8_t data) {
-  uint8_t result;
+  return ispHostTransfer(data);
+}
+#elif ! defined(ISP_GANG)
+
+template <ispclock_t CLOCK>
+static inline __attribute__((always_inline)) void ispTransferBit(uint8_t &data) {
+  asm volatile ("sbrc %0, 7\n" // MOSI = bit 7 in 5 cycles either way
+    "sbi %1, %3\n"
+    "sbrs %0, 7\n"
+    "cbi %1, %3\n"
+    "sbi %1, %4\n" // SCK rise
+    : "+d" (data)
+    : "I" (_SFR_IO_ADDR(ISP_PORT)), "I" (_SFR_IO_ADDR(ISP_PIN)), "I" (ISP_DO), "I" (ISP_SCK), "I" (ISP_DI));
+  __builtin_avr_delay_cycles(ispPadCycles(CLOCK, 5));
+  asm volatile ("lsl %0\n"
+    "sbic %2, %5\n" // Sample MISO in 2 cycles either way
+    "ori %0, 0x01\n"
+    "cbi %1, %4\n" // SCK fall
+    : "+d" (data)
+    : "I" (_SFR_IO_ADDR(ISP_PORT)), "I" (_SFR_IO_ADDR(ISP_PIN)), "I" (ISP_DO), "I" (ISP_SCK), "I" (ISP_DI));
+  __builtin_avr_delay_cycles(ispPadCycles(CLOCK, 7));
+}
+
+template <ispclock_t CLOCK>
+static uint8_t ispTransfer(uint8_t data) {
+  ispTransferBit<CLOCK>(data);
+  ispTransferBit<CLOCK>(data);
+  ispTransferBit<CLOCK>(data);
+  ispTransferBit<CLOCK>(data);
+  ispTransferBit<CLOCK>(data);
+  ispTransferBit<CLOCK>(data);
+  ispTransferBit<CLOCK>(data);
+  ispTransferBit<CLOCK>(data);
+  return data;
+}
+#else
+/*
+ * Both DI ports are sampled back to back right before SCK falls, the slot
+ * bits are shifted in during the low phase. The kernel is compiled code, so
+ * the pads assume its cheapest path and can only make phases longer.
+ */
+template <ispclock_t CLOCK>
+static uint8_t ispTransfer(uint8_t data) {
+  uint8_t in0 = 0, in1 = 0, in2 = 0, in3 = 0;
+
+  for (uint8_t i = 0; i < 8; ++i) {
+    uint8_t c, d;
 
-  for (uint8_t bit = 0; bit < 8; ++bit) {
     if (data & 0x80)
       ISP_PORT |= (1 << ISP_DO);
     else
       ISP_PORT &= ~(1 << ISP_DO);
     ISP_PORT |= (1 << ISP_SCK);
-    asm volatile ("nop\n"
-      "nop\n");
-    result <<= 1;
-    if (ISP_PIN & (1 << ISP_DI))
-      result |= 1;
+    __builtin_avr_delay_cycles(ispPadCycles(CLOCK, ISP_KERNEL_HIGH));
+    c = ISP_PIN;
+    d = ISP_DI3_PIN;
     ISP_PORT &= ~(1 << ISP_SCK);
-    asm volatile ("nop\n"
-      "nop\n");
     data <<= 1;
+    in0 = (in0 << 1) | ((c >> ISP_DI) & 0x01);
+    if (ISP_GANG > 1)
+      in1 = (in1 << 1) | ((c >> ISP_DI1) & 0x01);
+    if (ISP_GANG > 2)
+      in2 = (in2 << 1) | ((c >> ISP_DI2) & 0x01);
+    if (ISP_GANG > 3)
+      in3 = (in3 << 1) | ((d >> ISP_DI3) & 0x01);
+    __builtin_avr_delay_cycles(ispPadCycles(CLOCK, ISP_KERNEL_LOW));
+  }
+  ispIn[0] = in0;
+  if (ISP_GANG > 1)
+    ispIn[1] = in1;
+  if (ISP_GANG > 2)
+    ispIn[2] = in2;
+  if (ISP_GANG > 3)
+    ispIn[3] = in3;
+  return ispIn[ispLead];
+}
+#endif
+
+typedef uint8_t (*isptransfer_t)(uint8_t);
+
+static ispclock_t ispClock = ISP_CLOCK;
+static isptransfer_t ispTransferFunc = ispTransfer<ISP_CLOCK>;
+
+static void ispSetClock(ispclock_t clock) {
+  switch (clock) {
+    case ISP_CLOCK_8MHZ:
+      ispTransferFunc = ispTransfer<ISP_CLOCK_8MHZ>;
+      break;
+    case ISP_CLOCK_4MHZ:
+      ispTransferFunc = ispTransfer<ISP_CLOCK_4MHZ>;
+      break;
+    case ISP_CLOCK_2MHZ:
+      ispTransferFunc = ispTransfer<ISP_CLOCK_2MHZ>;
+      break;
+    case ISP_CLOCK_1MHZ:
+      ispTransferFunc = ispTransfer<ISP_CLOCK_1MHZ>;
+      break;
+    default:
+      clock = ISP_CLOCK_128KHZ;
+      ispTransferFunc = ispTransfer<ISP_CLOCK_128KHZ>;
+      break;
   }
+  ispClock = clock;
+}
+
+static inline uint8_t ispTransfer(uint8_t data) {
+#ifdef ISP_GANG
+  return ispTransferFunc(data);
+#else
+  return ispIn[0] = ispTransferFunc(data);
+#endif
+}
+
+static inline uint16_t ispClockKHz() {
+  return F_CPU / 1000 / ispBitCycles(ispClock);
+}
+
+static uint8_t ispExtAddr; // Load Extended Address byte the target holds, 0 after reset
+
+static uint8_t ispSync(ispclock_t clock) { // Slots answering Programming Enable
+  uint8_t result;
+
+  ispSetClock(clock);
+  ISP_PORT &= ~(1 << ISP_RST);
+  delay(20);
+  ispTransfer(0xAC);
+  ispTransfer(0x53);
+  ispTransfer(0x00);
+  result = ispSlots & ~ispMismatch(0x53);
+  ispTransfer(0x00);
   return result;
 }
 
+/*
+ * Speed ladder: sync at ISP_CLOCK (the fastest setting allowed by the build)
+ * and drop one step on each failure, down to ISP_CLOCK_128KHZ. Always starts
+ * from the top, so calling it again after a clock source fuse change
+ * renegotiates upward. If no setting syncs every slot, the fastest one
+ * syncing the most slots is used and the others are dropped.
+ */
 static bool ispBegin() {
-  bool result;
-  uint8_t retry = 5;
+  ispclock_t best = ISP_CLOCK;
+  uint8_t bestSlots = 0;
 
-  while (retry--) {
-    ISP_PORT &= ~(1 << ISP_RST);
-    delay(20);
-    ispTransfer(0xAC);
-    ispTransfer(0x53);
-    result = ispTransfer(0x00) == 0x53;
-    ispTransfer(0x00);
-    if (result)
-      break;
+  ispExtAddr = 0;
+  for (uint8_t clock = ISP_CLOCK; clock <= ISP_CLOCK_128KHZ; ++clock) {
+    uint8_t slots;
+
+    slots = ispSync((ispclock_t)clock);
+    if (slots == ispSlots)
+      return ispSlots;
+    if (ispSlotCount(slots) > ispSlotCount(bestSlots)) {
+      best = (ispclock_t)clock;
+      bestSlots = slots;
+    }
     ispReset();
   }
+  if (bestSlots)
+    ispDrop(ispSlots & ~ispSync(best));
+  else
+    ispDrop(ispSlots);
+  return ispSlots;
+}
+
+static uint8_t ispProbe() { // Slots answering at the slowest clock, the lines are released after it
+  uint8_t result;
+
+  ispInit();
+  result = ispSync(ISP_CLOCK_128KHZ);
+  ispDone();
   return result;
 }
 
@@ -81,10 +416,51 @@ static uint8_t ispCommand(uint8_t cmd1, uint8_t cmd2, uint8_t cmd3, uint8_t cmd4
   return ispTransfer(cmd4);
 }
 
-static void ispWait() {
-  while (ispCommand(0xF0, 0x00, 0x00) & 0x01) {
-    delay(1);
+constexpr uint16_t ISP_WAIT_STEP_MIN = 16; // 16 us.
+constexpr uint16_t ISP_WAIT_STEP_MAX = 256; // 256 us.
+
+static uint16_t ispBusyTime[ISP_WAITS]; // Last measured busy time in us, 0xFFFF on timeout
+static uint32_t ispLoadTime, ispWaitTime, ispVerifyTime; // Run totals in us: page loads, blocked in ispWait(), read-back
+static void (*ispIdle)() = nullptr; // Run between RDY/BSY polls, must take well under ISP_WAIT_STEP_MAX
+
+/*
+ * Polls RDY/BSY with a doubling back-off between polls, so the wait never
+ * overshoots the real busy time by more than ISP_WAIT_STEP_MAX plus one poll.
+ * Pass the micros() of the write command when other work ran since then.
+ */
+static bool ispWait(ispwait_t op, uint32_t start) {
+  uint32_t entry = micros();
+  uint32_t timeout, elapsed;
+  uint16_t step = ISP_WAIT_STEP_MIN;
+
+  timeout = ispDevice.wait[op] * 1000UL; // 10 times tWD
+  for (;;) {
+    uint8_t busy;
+
+    ispCommand(0xF0, 0x00, 0x00);
+    busy = ispMismatch(0x00, 0x01);
+    if (! busy)
+      break;
+    if (micros() - start >= timeout) {
+      ispBusyTime[op] = 0xFFFF;
+      ispWaitTime += micros() - entry;
+      ispDrop(busy);
+      return ispSlots;
+    }
+    if (ispIdle)
+      ispIdle();
+    delayMicroseconds(step);
+    if (step < ISP_WAIT_STEP_MAX)
+      step <<= 1;
   }
+  elapsed = micros() - start;
+  ispBusyTime[op] = elapsed < 0xFFFF ? elapsed : 0xFFFF;
+  ispWaitTime += micros() - entry;
+  return ispSlots;
+}
+
+static inline bool ispWait(ispwait_t op) {
+  return ispWait(op, micros());
 }
 
 static inline uint8_t ispReadLockBits() {
@@ -95,10 +471,12 @@ static inline void ispWriteLockBits(uint8_t bits) {
   ispCommand(0xAC, 0xE0, 0x00, bits);
 }
 
-static void ispReadSignature(uint8_t *sign) {
+static bool ispReadSignature(uint8_t *sign) { // Drops slots that differ from the first one
   for (uint8_t i = 0; i < 3; ++i) {
     sign[i] = ispCommand(0x30, 0x00, i);
+    ispMatch(sign[i]);
   }
+  return ispSlots;
 }
 
 static inline uint8_t ispReadLowFuseBits() {
@@ -125,10 +503,70 @@ static inline void ispWriteExtFuseBits(uint8_t bits) {
   ispCommand(0xAC, 0xA4, 0x00, bits);
 }
 
-static void ispChipErase() {
+static uint8_t ispReadFuse(ispfuse_t fuse) {
+  switch (fuse) {
+    case ISP_FUSE_LOCK:
+      return ispReadLockBits();
+    case ISP_FUSE_LOW:
+      return ispReadLowFuseBits();
+    case ISP_FUSE_HIGH:
+      return ispReadHighFuseBits();
+    case ISP_FUSE_EXT:
+      return ispReadExtFuseBits();
+    default:
+      return 0xFF;
+  }
+}
+
+constexpr uint8_t ISP_FUSE_DELAY = 5; // ms, tWD_FUSE is 4.5 ms
+constexpr uint8_t ISP_CLOCK_FUSE_BITS = 0x8F; // CKDIV8 and CKSEL3:0, in the low fuse on all ISP_DEVICES
+
+static void ispWriteFuse(ispfuse_t fuse, uint8_t bits) {
+  bits |= ~ispDevice.fuseMask[fuse]; // Unimplemented bits stay unprogrammed
+  switch (fuse) {
+    case ISP_FUSE_LOCK:
+      ispWriteLockBits(bits);
+      break;
+    case ISP_FUSE_LOW:
+      ispWriteLowFuseBits(bits);
+      break;
+    case ISP_FUSE_HIGH:
+      ispWriteHighFuseBits(bits);
+      break;
+    case ISP_FUSE_EXT:
+      ispWriteExtFuseBits(bits);
+      break;
+    default:
+      return;
+  }
+  delay(ISP_FUSE_DELAY);
+}
+
+static inline uint8_t ispFuseMismatch(ispfuse_t fuse, uint8_t bits) { // Slots differing in implemented bits, none is dropped
+  ispReadFuse(fuse);
+  return ispMismatch(bits, ispDevice.fuseMask[fuse]);
+}
+
+static inline bool ispVerifyFuse(ispfuse_t fuse, uint8_t bits) {
+  ispReadFuse(fuse);
+  return ispMatch(bits, ispDevice.fuseMask[fuse]);
+}
+
+static uint32_t ispApplicationSize() { // Flash below the boot section if BOOTRST is programmed
+  uint8_t boot;
+
+  if (ispDevice.bootFuse == ISP_FUSE_NONE)
+    return ispFlashSize();
+  boot = ispReadFuse(ispDevice.bootFuse) & 0x07;
+  if (boot & 0x01) // BOOTRST not set
+    return ispFlashSize();
+  return ispFlashSize() - ((uint32_t)ispDevice.bootSize << (3 - boot / 2)) * 2;
+}
+
+static bool ispChipErase() {
   ispCommand(0xAC, 0x80, 0x00, 0x00);
 //  delay(9);
-  ispWait();
+  return ispWait(ISP_WAIT_ERASE);
 }
 
 static inline uint8_t ispReadEeprom(uint16_t addr) {
@@ -138,95 +576,193 @@ static inline uint8_t ispReadEeprom(uint16_t addr) {
 static bool ispWriteEeprom(uint16_t addr, uint8_t data, bool verify = false) {
   ispCommand(0xC0, addr / 256, addr, data);
 //  delay(4);
-  ispWait();
+  if (! ispWait(ISP_WAIT_EEPROM))
+    return false;
   if (verify) {
-    return ispReadEeprom(addr) == data;
+    ispReadEeprom(addr);
+    return ispMatch(data);
   }
   return true;
 }
 
+static bool ispVerifyEepromPage(uint16_t addr, const uint8_t *page) {
+  uint32_t start = micros();
+  bool result = true;
+
+  for (uint8_t i = 0; result && (i < ispDevice.eepromPageSize); ++i) {
+    ispReadEeprom(addr + i);
+    result = ispMatch(page[i]);
+  }
+  ispVerifyTime += micros() - start;
+  return result;
+}
+
 static bool ispWriteEepromPage(uint16_t addr, const uint8_t *page, bool verify = false) {
-  addr &= 0xFFFC;
-  for (uint8_t i = 0; i < EEPROM_PAGE_SIZE; ++i) {
+  uint32_t start = micros();
+
+  addr &= ~(ispDevice.eepromPageSize - 1);
+  for (uint8_t i = 0; i < ispDevice.eepromPageSize; ++i) {
     ispCommand(0xC1, 0x00, i, page[i]);
   }
+  ispLoadTime += micros() - start;
   ispCommand(0xC2, addr / 256, addr, 0);
 //  delay(4);
-  ispWait();
-  if (verify) {
-    for (uint8_t i = 0; i < EEPROM_PAGE_SIZE; ++i) {
-      if (ispReadEeprom(addr + i) != page[i])
-        return false;
-    }
-  }
+  if (! ispWait(ISP_WAIT_EEPROM_PAGE))
+    return false;
+  if (verify)
+    return ispVerifyEepromPage(addr, page);
   return true;
 }
 
 static bool ispWriteEepromPage_P(uint16_t addr, const uint8_t *page, bool verify = false) {
-  addr &= 0xFFFC;
-  for (uint8_t i = 0; i < EEPROM_PAGE_SIZE; ++i) {
+  addr &= ~(ispDevice.eepromPageSize - 1);
+  for (uint8_t i = 0; i < ispDevice.eepromPageSize; ++i) {
     ispCommand(0xC1, 0x00, i, pgm_read_byte(&page[i]));
   }
   ispCommand(0xC2, addr / 256, addr, 0);
 //  delay(4);
-  ispWait();
+  if (! ispWait(ISP_WAIT_EEPROM_PAGE))
+    return false;
   if (verify) {
-    for (uint8_t i = 0; i < EEPROM_PAGE_SIZE; ++i) {
-      if (ispReadEeprom(addr + i) != pgm_read_byte(&page[i]))
+    for (uint8_t i = 0; i < ispDevice.eepromPageSize; ++i) {
+      ispReadEeprom(addr + i);
+      if (! ispMatch(pgm_read_byte(&page[i])))
         return false;
     }
   }
   return true;
 }
 
-static inline uint8_t ispReadFlash(uint16_t addr) {
+/*
+ * Flash addresses are byte addresses. Reads and page writes only carry word
+ * address bits 15:0, the bits above come from the Load Extended Address
+ * command, which is reissued only when the 64K words window changes.
+ */
+static inline void ispSetExtAddr(uint32_t addr) {
+  uint8_t ext = addr >> 17;
+
+  if (ext != ispExtAddr) {
+    ispCommand(0x4D, 0x00, ext, 0x00);
+    ispExtAddr = ext;
+  }
+}
+
+static inline uint8_t ispReadFlash(uint32_t addr) {
+  ispSetExtAddr(addr);
   return ispCommand(0x20 + 0x08 * (addr & 0x01), addr / 512, addr / 2);
 }
 
-static void ispFillFlashPage(uint16_t addr, uint16_t data = 0xFFFF) {
+static void ispCommitFlashPage(uint32_t addr) { // Starts the write, ispWait() for it before the next command
+  ispSetExtAddr(addr);
   addr /= 2;
-  addr &= 0xFFC0;
-  for (uint8_t i = 0; i < FLASH_PAGE_SIZE; ++i) {
+  addr &= ~(uint32_t)(ispDevice.flashPageSize - 1);
+  ispCommand(0x4C, addr / 256, addr, 0);
+}
+
+static bool ispFillFlashPage(uint32_t addr, uint16_t data = 0xFFFF) {
+  for (uint8_t i = 0; i < ispDevice.flashPageSize; ++i) {
     ispCommand(0x40, 0x00, i, data);
     ispCommand(0x48, 0x00, i, data / 256);
   }
-  ispCommand(0x4C, addr / 256, addr, 0);
+  ispCommitFlashPage(addr);
 //  delay(5);
-  ispWait();
+  return ispWait(ISP_WAIT_FLASH);
 }
 
-static bool ispWriteFlashPage(uint16_t addr, const uint8_t *page, bool verify = false) {
-  addr /= 2;
-  addr &= 0xFFC0;
-  for (uint8_t i = 0; i < FLASH_PAGE_SIZE; ++i) {
+/*
+ * Page loops are instantiated for each flashPageSize in ISP_DEVICES and picked
+ * once per page, so the inner loops keep constant bounds.
+ */
+template <uint8_t WORDS>
+static void ispLoadFlashPage(const uint8_t *page) {
+  for (uint8_t i = 0; i < WORDS; ++i) {
     ispCommand(0x40, 0x00, i, page[i * 2]);
     ispCommand(0x48, 0x00, i, page[i * 2 + 1]);
   }
-  ispCommand(0x4C, addr / 256, addr, 0);
-//  delay(5);
-  ispWait();
-  if (verify) {
-    for (uint8_t i = 0; i < FLASH_PAGE_SIZE; ++i) {
-      if ((ispReadFlash(addr * 2 + i * 2) != page[i * 2]) || (ispReadFlash(addr * 2 + i * 2 + 1) != page[i * 2 + 1]))
-        return false;
-    }
+}
+
+static void ispLoadFlashPage(const uint8_t *page) {
+  uint32_t start = micros();
+
+  switch (ispDevice.flashPageSize) {
+    case 32:
+      ispLoadFlashPage<32>(page);
+      break;
+    case 128:
+      ispLoadFlashPage<128>(page);
+      break;
+    default:
+      ispLoadFlashPage<64>(page);
+      break;
+  }
+  ispLoadTime += micros() - start;
+}
+
+template <uint8_t WORDS>
+static bool ispVerifyFlashPage(uint32_t addr, const uint8_t *page) {
+  addr &= ~(uint32_t)(WORDS * 2 - 1);
+  for (uint16_t i = 0; i < WORDS * 2; ++i) {
+    ispReadFlash(addr + i);
+    if (! ispMatch(page[i]))
+      return false;
   }
   return true;
 }
 
-static bool ispWriteFlashPage_P(uint16_t addr, const uint8_t *page, bool verify = false) {
-  addr /= 2;
-  addr &= 0xFFC0;
-  for (uint8_t i = 0; i < FLASH_PAGE_SIZE; ++i) {
+static bool ispVerifyFlashPage(uint32_t addr, const uint8_t *page) {
+  uint32_t start = micros();
+  bool result;
+
+  switch (ispDevice.flashPageSize) {
+    case 32:
+      result = ispVerifyFlashPage<32>(addr, page);
+      break;
+    case 128:
+      result = ispVerifyFlashPage<128>(addr, page);
+      break;
+    default:
+      result = ispVerifyFlashPage<64>(addr, page);
+      break;
+  }
+  ispVerifyTime += micros() - start;
+  return result;
+}
+
+static void ispReadFlashPage(uint32_t addr, uint8_t *page) { // From the lead slot
+  uint32_t start = micros();
+
+  addr &= ~(uint32_t)(ispFlashPageBytes() - 1);
+  for (uint16_t i = 0; i < ispFlashPageBytes(); ++i) {
+    page[i] = ispReadFlash(addr + i);
+  }
+  ispVerifyTime += micros() - start;
+}
+
+static bool ispWriteFlashPage(uint32_t addr, const uint8_t *page, bool verify = false) {
+  ispLoadFlashPage(page);
+  ispCommitFlashPage(addr);
+//  delay(5);
+  if (! ispWait(ISP_WAIT_FLASH))
+    return false;
+  if (verify)
+    return ispVerifyFlashPage(addr, page);
+  return true;
+}
+
+static bool ispWriteFlashPage_P(uint32_t addr, const uint8_t *page, bool verify = false) {
+  addr &= ~(uint32_t)(ispFlashPageBytes() - 1);
+  for (uint8_t i = 0; i < ispDevice.flashPageSize; ++i) {
     ispCommand(0x40, 0x00, i, pgm_read_byte(&page[i * 2]));
     ispCommand(0x48, 0x00, i, pgm_read_byte(&page[i * 2 + 1]));
   }
-  ispCommand(0x4C, addr / 256, addr, 0);
+  ispCommitFlashPage(addr);
 //  delay(5);
-  ispWait();
+  if (! ispWait(ISP_WAIT_FLASH))
+    return false;
   if (verify) {
-    for (uint8_t i = 0; i < FLASH_PAGE_SIZE; ++i) {
-      if ((ispReadFlash(addr * 2 + i * 2) != pgm_read_byte(&page[i * 2])) || (ispReadFlash(addr * 2 + i * 2 + 1) != pgm_read_byte(&page[i * 2 + 1])))
+    for (uint16_t i = 0; i < ispFlashPageBytes(); ++i) {
+      ispReadFlash(addr + i);
+      if (! ispMatch(pgm_read_byte(&page[i])))
         return false;
     }
   }
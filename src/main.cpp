@@ -2,10 +2,21 @@
 #include <avr/sleep.h>
 #include <Arduino.h>
 #include <SPI.h>
-#include <SD.h>
 #include "isp.h"
+#include "avi.h"
+#include "storage.h"
+#include "stk.h"
+#include "upload.h"
+#include "tasks.h"
 
 #define USE_HEAP
+#define USE_AVI
+#define DUMP_BIN // Binary backup next to the HEX one: AVI image with USE_AVI, raw otherwise
+#define USE_CACHE // Burn HEX files through a page cache on SD, rebuilt when the HEX changes
+#define USE_STK // STK500v2 programmer on Serial instead of the SD card if the button is held at power-up
+#define USE_UPLOAD // Image upload to the SD card over Serial with tools/upload.py while waiting for the button
+//#define PRODUCTION // Stay awake with the SD mounted and burn the next target on each button click
+//#define AUTO_START // Also start when a target is seated, see attachTask()
 
 #define FPSTR(s)  ((__FlashStringHelper*)(s))
 
@@ -24,8 +35,34 @@ constexpr bool LED_LEVEL = LOW;
 constexpr uint8_t SD_PIN = 10;
 
 constexpr uint8_t HEX_PAGE_SIZE = 16;
+constexpr uint16_t HEX_BUFFER_SIZE = 512; // One SD block
+constexpr uint8_t HEX_RECORD_SIZE = 32; // Data bytes per record in dumps
+constexpr uint8_t IMAGE_LZ_BUFFER = 64; // Read size of AVI_FLAG_LZ payloads, the card library caches the block
 
 constexpr uint32_t BLINK_TIME = 50; // 50 ms.
+constexpr uint16_t RESULT_TIME = 1000; // 1 s.
+constexpr uint16_t SLOT_TIME = 500; // 0.5 s. per gang slot in the result, half of it lit
+
+constexpr uint16_t ATTACH_PERIOD = 250; // 250 ms. between probes, a probe holds RST low for 20 ms
+constexpr uint8_t ATTACH_CONFIRM = 3; // Probes in a row for a target to count as seated or removed
+
+/*
+ * Flash verify policy. VERIFY_PAGE reads each page back right after its write,
+ * VERIFY_DEFERRED reads the whole image back in a second pass over the source
+ * once every page is written, VERIFY_SAMPLED reads back the first and last
+ * pages and about one in VERIFY_SAMPLE_RATE others, VERIFY_NONE trusts the
+ * writes. Its cost is the Verify phase of the run stats, the whole second
+ * pass for VERIFY_DEFERRED. Set it from the build with e.g.
+ * -DVERIFY_POLICY=VERIFY_DEFERRED.
+ */
+enum verify_t : uint8_t { VERIFY_PAGE, VERIFY_DEFERRED, VERIFY_SAMPLED, VERIFY_NONE };
+
+#ifndef VERIFY_POLICY
+#define VERIFY_POLICY VERIFY_PAGE
+#endif
+constexpr uint8_t VERIFY_SAMPLE_RATE = 16;
+
+static const char VERIFY_NAMES[][9] PROGMEM = { "page", "deferred", "sampled", "none" };
 
 static const char FUSES_NAME[] PROGMEM = "fuses.txt";
 static const char FUSES_BACKUP_NAME[] PROGMEM = "fuses.bak";
@@ -33,12 +70,64 @@ static const char EEPROM_NAME[] PROGMEM = "eeprom.hex";
 static const char EEPROM_BACKUP_NAME[] PROGMEM = "eeprom.bak";
 static const char FIRMWARE_NAME[] PROGMEM = "firmware.hex";
 static const char FIRMWARE_BACKUP_NAME[] PROGMEM = "firmware.bak";
+static const char EEPROM_IMAGE_NAME[] PROGMEM = "eeprom.avi";
+static const char FIRMWARE_IMAGE_NAME[] PROGMEM = "firmware.avi";
+#ifdef USE_AVI
+static const char EEPROM_BIN_BACKUP_NAME[] PROGMEM = "eeprom.avb"; // AVI image, rename to .avi to restore
+static const char FIRMWARE_BIN_BACKUP_NAME[] PROGMEM = "firmware.avb";
+#else
+static const char EEPROM_BIN_BACKUP_NAME[] PROGMEM = "eeprom.bin";
+static const char FIRMWARE_BIN_BACKUP_NAME[] PROGMEM = "firmware.bin";
+#endif
+#ifdef USE_CACHE
+static const char FIRMWARE_CACHE_NAME[] PROGMEM = "firmware.avc";
+#endif
+static const char SERIAL_NAME[] PROGMEM = "serial.txt";
+static const char RUNLOG_NAME[] PROGMEM = "runlog.csv";
 
 static const char FAIL_OR_OK[][6] PROGMEM = { "FAIL!", "Done" };
+static const char ALREADY_CURRENT[] PROGMEM = "Already current";
 static const char HEX_LINE_HAS[] PROGMEM = "\r\nHEX line has ";
+static const char CHIP_ERASE_ERROR[] PROGMEM = "\r\nChip erase timeout!";
+static const char EEPROM_WRITE_ERROR[] PROGMEM = "\r\nEEPROM write error!";
+static const char FLASH_WRITE_ERROR[] PROGMEM = "\r\nFlash write error!";
+static const char FLASH_VERIFY_ERROR[] PROGMEM = "\r\nFlash verify error!";
+#ifdef USE_AVI
+static const char WRONG_IMAGE[] PROGMEM = "\r\nWrong image header!";
+static const char IMAGE_READ_ERROR[] PROGMEM = "\r\nImage read error!";
+static const char IMAGE_CRC_ERROR[] PROGMEM = "\r\nImage CRC error!";
+#endif
+#ifdef USE_CACHE
+static const char CACHE_ERROR[] PROGMEM = "\r\nCache error!";
+#endif
+
+/*
+ * Run phases in us for the summary and runlog.csv. Dump and fuses include the
+ * SD and ISP time spent inside them, ISP phases come from the isp.h totals.
+ */
+enum phase_t : uint8_t { PHASE_SD_OPEN, PHASE_SD_READ, PHASE_HEX_PARSE, PHASE_ISP_LOAD, PHASE_ISP_BUSY, PHASE_VERIFY, PHASE_DUMP, PHASE_FUSES };
+
+constexpr uint8_t PHASES = PHASE_FUSES + 1;
+
+static const char PHASE_NAMES[PHASES][10] PROGMEM = { "SD open", "SD read", "HEX parse", "ISP load", "ISP busy", "Verify", "Dump", "Fuses" };
+static const char RUNLOG_HEADER[] PROGMEM = "ms,result,device,isp_khz,sd_open_us,sd_read_us,hex_parse_us,isp_load_us,isp_busy_us,verify_us,dump_us,fuses_us,unit,verify,saved_ms,sd_mhz,source";
+
+enum source_t : uint8_t { SOURCE_NONE, SOURCE_HEX, SOURCE_CACHE, SOURCE_AVI, SOURCE_LZ };
+
+static const char SOURCE_NAMES[][6] PROGMEM = { "", "hex", "cache", "avi", "lz" };
 
 File f;
 bool error = false;
+static uint32_t phaseTime[PHASES];
+static uint32_t runStart, runTime; // ms
+static uint16_t runCount = 0;
+static uint32_t unitNumber; // Valid if unitNumbered
+static bool unitNumbered = false;
+static bool flashCurrent, eepromCurrent, fusesCurrent, lockCurrent; // Nothing had to be burned
+static uint8_t lockBits; // From the fuses file, burned by programLock()
+static bool lockPending = false;
+static uint32_t flashSaved; // us, estimated when flashCurrent
+static source_t flashSource; // What the flash was burned from
 
 static bool fexists(PGM_P fileName) {
   char name[13];
@@ -47,111 +136,310 @@ static bool fexists(PGM_P fileName) {
   return SD.exists(name);
 }
 
+static File sdOpen(const char *name, uint8_t mode) {
+  uint32_t start = micros();
+  File result;
+
+  result = SD.open(name, mode);
+  phaseTime[PHASE_SD_OPEN] += micros() - start;
+  return result;
+}
+
+static int16_t sdRead(void *buf, uint16_t size) { // From f
+  uint32_t start = micros();
+  int16_t result;
+
+  result = f.read(buf, size);
+  phaseTime[PHASE_SD_READ] += micros() - start;
+  return result;
+}
+
+/*
+ * Text files are read in whole SD blocks into hexBuffer and decoded from
+ * there, so records split across blocks need no copying. hexOpen() must be
+ * called after opening f and hexClose() before closing it.
+ */
+#ifdef USE_HEAP
+static char *hexBuffer = nullptr;
+#else
+static char hexBuffer[HEX_BUFFER_SIZE];
+#endif
+static uint16_t hexPos, hexLen;
+static uint16_t hexAddr; // Continuation of a record longer than HEX_PAGE_SIZE
+static uint32_t hexBase; // From the last SEGMENT or EXTADDR record
+static uint8_t hexRemain, hexCrc;
+static hextype_t hexType;
+static uint32_t hexBytes, hexReadTime, hexParseTime; // Throughput counters, reset by hexOpen()
+
+static const uint8_t HEX_NIBBLES['f' - '0' + 1] PROGMEM = {
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, // '0'..'9'
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, // ':'..'@'
+  10, 11, 12, 13, 14, 15, // 'A'..'F'
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, // 'G'..'`'
+  10, 11, 12, 13, 14, 15 // 'a'..'f'
+};
+
+static void hexOpen() {
+#ifdef USE_HEAP
+  hexBuffer = new char[HEX_BUFFER_SIZE];
+#endif
+  hexPos = hexLen = 0;
+  hexRemain = 0;
+  hexBase = 0;
+  hexBytes = hexReadTime = hexParseTime = 0;
+}
+
+static void hexRewind() {
+  f.seek(0);
+  hexPos = hexLen = 0;
+  hexRemain = 0;
+  hexBase = 0;
+}
+
+static void hexBookTimes() { // Into the run phases
+  phaseTime[PHASE_SD_READ] += hexReadTime;
+  if (hexParseTime > hexReadTime) // Parsing includes the reads it triggers
+    phaseTime[PHASE_HEX_PARSE] += hexParseTime - hexReadTime;
+}
+
+static void hexClose() {
+  hexBookTimes();
+#ifdef USE_HEAP
+  delete[] hexBuffer;
+  hexBuffer = nullptr;
+#endif
+}
+
+static int16_t hexFill() {
+  uint32_t start = micros();
+  int16_t len;
+
+#ifdef USE_HEAP
+  if (! hexBuffer) // Reported as HEX_NOMEM by parseHexLine()
+    return -1;
+#endif
+  len = f.read(hexBuffer, HEX_BUFFER_SIZE);
+  hexReadTime += micros() - start;
+  if (len <= 0)
+    return -1;
+  hexBytes += len;
+  hexLen = len;
+  hexPos = 1;
+  return (uint8_t)hexBuffer[0];
+}
+
+static inline int16_t hexGet() { // -1 at end of file
+  return hexPos < hexLen ? (uint8_t)hexBuffer[hexPos++] : hexFill();
+}
+
+/*
+ * The VERIFY_DEFERRED pass is booked as Verify as a whole: the SD reads and
+ * the parsing it triggers are taken back from their phases.
+ */
+struct verifypass_t {
+  uint32_t start, sdRead, hexRead, hexParse, ispVerify;
+};
+
+static void beginVerifyPass(verifypass_t &pass) {
+  pass.sdRead = phaseTime[PHASE_SD_READ];
+  pass.hexRead = hexReadTime;
+  pass.hexParse = hexParseTime;
+  pass.ispVerify = ispVerifyTime;
+  pass.start = micros();
+}
+
+static void endVerifyPass(const verifypass_t &pass) {
+  ispVerifyTime = pass.ispVerify + (micros() - pass.start);
+  phaseTime[PHASE_SD_READ] = pass.sdRead;
+  hexReadTime = pass.hexRead;
+  hexParseTime = pass.hexParse;
+}
+
+static inline uint8_t hexNibble(int16_t c) { // 0xFF if not a hex digit
+  return (c >= '0') && (c <= 'f') ? pgm_read_byte(&HEX_NIBBLES[c - '0']) : 0xFF;
+}
+
 static uint8_t freadUntil(char *str, uint8_t size, char terminator, char tail) {
-  size = f.readBytesUntil(terminator, str, size - 1);
-  if (size && (str[size - 1] == tail))
-    --size;
-  str[size] = '\0';
-  return size;
+  uint8_t len = 0;
+  int16_t c;
+
+  while (((c = hexGet()) >= 0) && (c != terminator)) {
+    if (len < size - 1)
+      str[len++] = c;
+  }
+  if (len && (str[len - 1] == tail))
+    --len;
+  str[len] = '\0';
+  return len;
 }
 
 static bool parseHexNum(const char *str, uint8_t &num) {
-  uint8_t result;
-
-  if ((*str >= '0') && (*str <= '9'))
-    result = *str - '0';
-  else if ((*str >= 'A') && (*str <= 'F'))
-    result = *str - 'A' + 10;
-  else if ((*str >= 'a') && (*str <= 'f'))
-    result = *str - 'a' + 10;
-  else
+  uint8_t hi, lo;
+
+  hi = hexNibble((uint8_t)str[0]);
+  if (hi > 0x0F)
     return false;
-  result <<= 4;
-  ++str;
-  if ((*str >= '0') && (*str <= '9'))
-    result |= *str - '0';
-  else if ((*str >= 'A') && (*str <= 'F'))
-    result |= *str - 'A' + 10;
-  else if ((*str >= 'a') && (*str <= 'f'))
-    result |= *str - 'a' + 10;
-  else
+  lo = hexNibble((uint8_t)str[1]);
+  if (lo > 0x0F)
     return false;
-  num = result;
+  num = (hi << 4) | lo;
   return true;
 }
 
-static hexparse_t parseHexLine(uint8_t &len, uint16_t &addr, hextype_t &type, uint8_t *data) {
-  constexpr uint8_t LINE_SIZE = HEX_PAGE_SIZE * 2 + 13 + 1;
+static hexparse_t parseHexField(uint8_t &num, hexparse_t error) { // Line end in the record header is HEX_TOOSHORT
+  int16_t c;
+  uint8_t hi, lo;
 
-#ifdef USE_HEAP
-  char *str;
-#else
-  char str[LINE_SIZE];
-#endif
-  uint8_t l, crc;
-#ifdef USE_HEAP
-  hexparse_t result = HEX_NOMEM;
-#else
+  c = hexGet();
+  hi = hexNibble(c);
+  if (hi <= 0x0F) {
+    c = hexGet();
+    lo = hexNibble(c);
+    if (lo <= 0x0F) {
+      num = (hi << 4) | lo;
+      return HEX_OK;
+    }
+  }
+  if (((c < 0) || (c == '\r') || (c == '\n')) && (error <= HEX_WRONGTYPE))
+    return HEX_TOOSHORT;
+  return error;
+}
+
+/*
+ * Records of any length are returned in chunks of up to HEX_PAGE_SIZE bytes
+ * with consecutive addresses; the record CRC is checked with the last chunk.
+ */
+static hexparse_t parseHexRecord(uint8_t &len, uint16_t &addr, hextype_t &type, uint8_t *data) {
   hexparse_t result;
-#endif
+  uint8_t l;
 
 #ifdef USE_HEAP
-  str = new char[LINE_SIZE];
-  if (str) {
+  if (! hexBuffer)
+    return HEX_NOMEM;
 #endif
-    l = freadUntil(str, LINE_SIZE, '\n', '\r');
-    if (l < 11) {
-      result = HEX_TOOSHORT;
-      goto free_and_return;
-    }
-    if (str[0] != ':') {
-      result = HEX_WRONGSTART;
-      goto free_and_return;
-    }
-    if ((! parseHexNum(&str[1], len)) || (len > HEX_PAGE_SIZE)) {
-      result = HEX_WRONGLEN;
-      goto free_and_return;
-    }
-    crc = len;
-    if (! parseHexNum(&str[3], l)) {
-      result = HEX_WRONGADDRHI;
-      goto free_and_return;
-    }
-    addr = l << 8;
-    crc += l;
-    if (! parseHexNum(&str[5], l)) {
-      result = HEX_WRONGADDRLO;
-      goto free_and_return;
-    }
-    addr |= l;
-    crc += l;
-    if ((! parseHexNum(&str[7], l)) || (l > HEX_START32)) {
-      result = HEX_WRONGTYPE;
-      goto free_and_return;
-    }
-    type = (hextype_t)l;
-    crc += l;
-    for (uint8_t i = 0; i < len; ++i) {
-      if (! parseHexNum(&str[9 + i * 2], data[i])) {
-        result = HEX_WRONGDATA;
-        goto free_and_return;
-      }
-      crc += data[i];
-    }
-    crc = 0 - crc;
-    if ((! parseHexNum(&str[9 + len * 2], l)) || (l != crc)) {
-      result = HEX_WRONGCRC;
-      goto free_and_return;
+  if (! hexRemain) {
+    int16_t c;
+
+    do {
+      c = hexGet();
+    } while ((c == '\r') || (c == '\n'));
+    if (c < 0)
+      return HEX_TOOSHORT;
+    if (c != ':')
+      return HEX_WRONGSTART;
+    if ((result = parseHexField(hexRemain, HEX_WRONGLEN)) != HEX_OK)
+      return result;
+    hexCrc = hexRemain;
+    if ((result = parseHexField(l, HEX_WRONGADDRHI)) != HEX_OK)
+      return result;
+    hexAddr = l << 8;
+    hexCrc += l;
+    if ((result = parseHexField(l, HEX_WRONGADDRLO)) != HEX_OK)
+      return result;
+    hexAddr |= l;
+    hexCrc += l;
+    if ((result = parseHexField(l, HEX_WRONGTYPE)) != HEX_OK)
+      return result;
+    if (l > HEX_START32)
+      return HEX_WRONGTYPE;
+    if ((l != HEX_BIN) && (hexRemain > HEX_PAGE_SIZE))
+      return HEX_WRONGLEN;
+    hexType = (hextype_t)l;
+    hexCrc += l;
+  }
+  len = hexRemain < HEX_PAGE_SIZE ? hexRemain : HEX_PAGE_SIZE;
+  addr = hexAddr;
+  type = hexType;
+  for (uint8_t i = 0; i < len; ++i) {
+    if ((result = parseHexField(data[i], HEX_WRONGDATA)) != HEX_OK)
+      return result;
+    hexCrc += data[i];
+  }
+  hexRemain -= len;
+  hexAddr += len;
+  if (! hexRemain) {
+    if ((result = parseHexField(l, HEX_WRONGCRC)) != HEX_OK)
+      return result;
+    if ((uint8_t)(hexCrc + l))
+      return HEX_WRONGCRC;
+  }
+  return HEX_OK;
+}
+
+/*
+ * BIN records come back with their full 32-bit address, SEGMENT and EXTADDR
+ * records set the base for the following ones. Other records keep the raw
+ * 16-bit offset.
+ */
+static hexparse_t parseHexLine(uint8_t &len, uint32_t &addr, hextype_t &type, uint8_t *data) {
+  uint32_t start = micros();
+  hexparse_t result;
+  uint16_t offset;
+
+  result = parseHexRecord(len, offset, type, data);
+  if (result == HEX_OK) {
+    addr = offset;
+    if (type == HEX_BIN)
+      addr += hexBase;
+    else if ((type == HEX_SEGMENT) || (type == HEX_EXTADDR)) {
+      if (len != 2)
+        result = HEX_WRONGLEN;
+      else if (offset)
+        result = HEX_WRONGADDRLO;
+      else
+        hexBase = ((uint32_t)data[0] << 8 | data[1]) << (type == HEX_SEGMENT ? 4 : 16);
     }
-    result = HEX_OK;
-free_and_return:
-#ifdef USE_HEAP
-    delete[] str;
   }
-#endif
+  hexParseTime += micros() - start;
   return result;
 }
 
+/*
+ * Dumps format records into hexBuffer (between hexOpen() and hexClose(), on a
+ * freshly created f) and write it out in whole blocks, which stay aligned to
+ * SD blocks because the file starts empty.
+ */
+static const char HEX_DIGITS[] PROGMEM = "0123456789ABCDEF";
+
+static bool hexWriteOk;
+
+static void hexFlush() {
+  if (hexLen) {
+    hexWriteOk = hexWriteOk && (f.write((const uint8_t*)hexBuffer, hexLen) == hexLen);
+    hexLen = 0;
+  }
+}
+
+static inline void hexPut(char c) {
+  hexBuffer[hexLen++] = c;
+  if (hexLen >= HEX_BUFFER_SIZE)
+    hexFlush();
+}
+
+static void hexPutByte(uint8_t value) {
+  hexPut(pgm_read_byte(&HEX_DIGITS[value >> 4]));
+  hexPut(pgm_read_byte(&HEX_DIGITS[value & 0x0F]));
+}
+
+static void hexPutRecord(uint16_t addr, hextype_t type, const uint8_t *data, uint8_t len) {
+  uint8_t crc;
+
+  crc = len + (addr / 256) + (addr & 0xFF) + type;
+  hexPut(':');
+  hexPutByte(len);
+  hexPutByte(addr / 256);
+  hexPutByte(addr);
+  hexPutByte(type);
+  for (uint8_t i = 0; i < len; ++i) {
+    hexPutByte(data[i]);
+    crc += data[i];
+  }
+  hexPutByte(0 - crc);
+  hexPut('\r');
+  hexPut('\n');
+}
+
 static void printParseError(hexparse_t parse) {
   switch (parse) {
 #ifdef USE_HEAP
@@ -209,7 +497,7 @@ static const char *hex(char *str, uint8_t value) {
   return str;
 }
 
-static uint8_t dataLength(const uint8_t *data, uint8_t size) {
+static uint16_t dataLength(const uint8_t *data, uint16_t size) {
   while (size) {
     if (data[size - 1] != 0xFF)
       break;
@@ -218,7 +506,10 @@ static uint8_t dataLength(const uint8_t *data, uint8_t size) {
   return size;
 }
 
-static void printPercent(uint8_t percent) {
+static void printPercent(uint8_t percent) { // Skipped while the UART is busy, the next one tells more
+  taskYield();
+  if (Serial.availableForWrite() < 8)
+    return;
   if (percent < 100)
     Serial.write(' ');
   if (percent < 10)
@@ -227,11 +518,163 @@ static void printPercent(uint8_t percent) {
   Serial.print(F("%\b\b\b\b"));
 }
 
+static void printIspClock() {
+  Serial.print(F("ISP clock: "));
+  Serial.print(ispClockKHz());
+  Serial.println(F(" kHz"));
+}
+
+#ifdef ISP_GANG
+static void printSlots() {
+  for (uint8_t slot = 0; slot < ISP_GANG; ++slot) {
+    Serial.print(F("Slot "));
+    Serial.print(slot);
+    Serial.print(F(": "));
+    Serial.println(FPSTR(FAIL_OR_OK[(ispSlots >> slot) & 0x01]));
+  }
+}
+#endif
+
+static void printHexStats() { // Also of an AVI_FLAG_LZ image, see lzGet()
+  if (hexBytes >= 64) {
+    Serial.print(flashSource == SOURCE_LZ ? F("LZ read: ") : F("HEX read: "));
+    Serial.print(hexReadTime * 16 / (hexBytes / 64));
+    Serial.print(flashSource == SOURCE_LZ ? F(" us/KB, unpack: ") : F(" us/KB, parse: "));
+    Serial.print((hexParseTime - hexReadTime) * 16 / (hexBytes / 64));
+    Serial.println(F(" us/KB"));
+  }
+}
+
+static PGM_P sourceName(PGM_P hexName, PGM_P imageName) {
+#ifdef USE_AVI
+  if (fexists(imageName))
+    return imageName;
+#endif
+  return fexists(hexName) ? hexName : nullptr;
+}
+
+#ifdef DUMP_BIN
+static bool createBin(File &bin, PGM_P fileName, aviheader_t &header, avimemory_t memory, uint32_t length, uint16_t pageSize) {
+  char name[13];
+
+  strcpy_P(name, fileName);
+  bin = sdOpen(name, O_WRITE | O_CREAT | O_TRUNC);
+  if (bin) {
+#ifdef USE_AVI
+    uint8_t sign[3];
+
+    sdReserve(bin, sizeof(header) + length);
+    ispReadSignature(sign);
+    aviInitHeader(header, sign, memory, 0, length, pageSize);
+    return bin.write((const uint8_t*)&header, sizeof(header)) == sizeof(header);
+#else
+    sdReserve(bin, length);
+    return true;
+#endif
+  }
+  return false;
+}
+
+static bool closeBin(File &bin, aviheader_t &header, uint32_t crc) {
+  bool result = sdTrim(bin);
+
+#ifdef USE_AVI
+  header.crc = ~crc;
+  result = result && bin.seek(0) && (bin.write((const uint8_t*)&header, sizeof(header)) == sizeof(header));
+#endif
+  bin.close();
+  return result;
+}
+#endif
+
+#ifdef USE_AVI
+static bool readImageHeader(aviheader_t &header, avimemory_t memory, uint16_t pageSize, uint32_t size) {
+  uint8_t sign[3];
+
+  ispReadSignature(sign);
+  return (sdRead(&header, sizeof(header)) == sizeof(header)) && aviCheckHeader(header, sign, memory, pageSize, size) &&
+    (header.flags & AVI_FLAG_LZ ? memory == AVI_FLASH : f.size() == sizeof(header) + header.length);
+}
+
+/*
+ * An AVI_FLAG_LZ payload is read IMAGE_LZ_BUFFER bytes at a time into
+ * lzInput and decoded by lz straight into the page buffer. Reads and
+ * unpacking go to the hex throughput counters, unpacking is booked as HEX
+ * parse.
+ */
+static uint8_t *lzInput;
+static uint8_t lzInputPos, lzInputLen;
+
+static int16_t lzGet() { // -1 at end of file
+  if (lzInputPos >= lzInputLen) {
+    uint32_t start = micros();
+    int16_t len;
+
+    len = f.read(lzInput, IMAGE_LZ_BUFFER);
+    hexReadTime += micros() - start;
+    if (len <= 0)
+      return -1;
+    hexBytes += len;
+    lzInputLen = len;
+    lzInputPos = 0;
+  }
+  return lzInput[lzInputPos++];
+}
+
+static bool readImagePage(avilz_t *lz, uint8_t *buf, uint16_t pageSize) { // Next page of the payload
+  uint32_t start;
+  bool result;
+
+  if (! lz)
+    return sdRead(buf, pageSize) == pageSize;
+  start = micros();
+  result = aviLzRead(*lz, buf, pageSize, lzGet);
+  hexParseTime += micros() - start;
+  return result;
+}
+
+static bool rewindImage(avilz_t *lz) { // To the first page of the payload
+  if (! f.seek(sizeof(aviheader_t)))
+    return false;
+  if (lz) {
+    lzInputPos = lzInputLen = 0;
+    aviLzBegin(*lz);
+  }
+  return true;
+}
+
+/*
+ * Read-only pass over the payload before anything is erased or written, so a
+ * corrupt or truncated image leaves the target as it was. The payload is
+ * rewound for the burn.
+ */
+static bool checkImage(const aviheader_t &header, avilz_t *lz, uint8_t *buf, uint16_t pageSize) {
+  uint32_t crc = CRC32_INIT;
+  bool ok;
+
+  ok = rewindImage(lz);
+  for (uint32_t len = 0; ok && (len < header.length); len += pageSize) {
+    ok = readImagePage(lz, buf, pageSize);
+    crc = crc32Update(crc, buf, pageSize);
+    taskYield();
+  }
+  if (! ok)
+    Serial.println(FPSTR(IMAGE_READ_ERROR));
+  else if (~crc != header.crc) {
+    Serial.println(FPSTR(IMAGE_CRC_ERROR));
+    ok = false;
+  }
+  return ok && rewindImage(lz);
+}
+#endif
+
 static bool dumpFuses(PGM_P fileName) {
+  uint32_t start = micros();
   char name[13];
+  bool result = false;
 
   strcpy_P(name, fileName);
-  f = SD.open(name, O_WRITE | O_CREAT | O_TRUNC);
+  f = sdOpen(name, O_WRITE | O_CREAT | O_TRUNC);
   if (f) {
     f.print(F("LB:"));
     f.println(hex(name, ispReadLockBits()));
@@ -242,137 +685,295 @@ static bool dumpFuses(PGM_P fileName) {
     f.print(F(";E:"));
     f.println(hex(name, ispReadExtFuseBits()));
     f.close();
-    return true;
+    result = true;
   }
-  return false;
+  phaseTime[PHASE_DUMP] += micros() - start;
+  return result;
+}
+
+/*
+ * Fuses are written as one transaction: only the ones differing from the
+ * target in implemented bits are written, the target is synced again only if
+ * the clock source changed and all of them are read back at the end.
+ */
+static bool burnFuses(const uint8_t *bits) {
+  bool resync = false;
+
+  fusesCurrent = true;
+  for (uint8_t fuse = ISP_FUSE_LOW; fuse < ISP_FUSES; ++fuse) {
+    if (ispFuseMismatch((ispfuse_t)fuse, bits[fuse])) {
+      if ((fuse == ISP_FUSE_LOW) && ispMismatch(bits[fuse], ispDevice.fuseMask[fuse] & ISP_CLOCK_FUSE_BITS))
+        resync = true;
+      ispWriteFuse((ispfuse_t)fuse, bits[fuse]);
+      fusesCurrent = false;
+    }
+  }
+  if (resync) { // New clock source, the ISP clock is negotiated again
+    ispReset();
+    if (! ispBegin())
+      return false;
+  }
+  for (uint8_t fuse = ISP_FUSE_LOW; fuse < ISP_FUSES; ++fuse) {
+    if (! ispVerifyFuse((ispfuse_t)fuse, bits[fuse]))
+      return false;
+  }
+  return true;
 }
 
-static bool programFuses(PGM_P fileName, bool lock = false) {
+static bool programFuses(PGM_P fileName) { // Lock bits are kept for programLock()
   constexpr uint8_t STR_SIZE = 17;
 
+  uint32_t start = micros();
   char name[13];
   bool result = false;
 
   strcpy_P(name, fileName);
-  f = SD.open(name, O_READ);
+  f = sdOpen(name, O_READ);
   if (f) {
 #ifdef USE_HEAP
     char *str;
 #else
     char str[STR_SIZE];
 #endif
-    uint8_t lb, lf, hf, ef;
+    uint8_t bits[ISP_FUSES];
 
 #ifdef USE_HEAP
     str = new char[STR_SIZE];
     if (str) {
 #endif
+      hexOpen();
       if ((freadUntil(str, STR_SIZE, '\n', '\r') == 5) &&
-        (! strncmp_P(str, PSTR("LB:"), 3)) && parseHexNum(&str[3], lb)) { // "LB:XX"
+        (! strncmp_P(str, PSTR("LB:"), 3)) && parseHexNum(&str[3], bits[ISP_FUSE_LOCK])) { // "LB:XX"
         if ((freadUntil(str, STR_SIZE, '\n', '\r') == 14) &&
-          (! strncmp_P(str, PSTR("L:"), 2)) && parseHexNum(&str[2], lf) &&
-          (! strncmp_P(&str[5], PSTR("H:"), 2)) && parseHexNum(&str[7], hf) &&
-          (! strncmp_P(&str[10], PSTR("E:"), 2)) && parseHexNum(&str[12], ef)) { // "L:XX;H:XX;E:XX"
-          ispWriteLowFuseBits(lf);
-          ispReset();
-          result = ispBegin();
-          if (result) {
-            ispWriteHighFuseBits(hf);
-            ispReset();
-            result = ispBegin();
-          }
-          if (result) {
-            ispWriteExtFuseBits(ef);
-            ispReset();
-            result = ispBegin();
-          }
-          if (result && lock) {
-            ispWriteLockBits(lb);
-            ispReset();
-            result = ispBegin();
-          }
+          (! strncmp_P(str, PSTR("L:"), 2)) && parseHexNum(&str[2], bits[ISP_FUSE_LOW]) &&
+          (! strncmp_P(&str[5], PSTR("H:"), 2)) && parseHexNum(&str[7], bits[ISP_FUSE_HIGH]) &&
+          (! strncmp_P(&str[10], PSTR("E:"), 2)) && parseHexNum(&str[12], bits[ISP_FUSE_EXT])) { // "L:XX;H:XX;E:XX"
+          result = burnFuses(bits);
+          lockBits = bits[ISP_FUSE_LOCK];
+          lockPending = result;
         }
       }
+      hexClose();
 #ifdef USE_HEAP
       delete[] str;
     }
 #endif
     f.close();
   }
+  phaseTime[PHASE_FUSES] += micros() - start;
+  return result;
+}
+
+static bool programLock() { // Last, once flash and EEPROM are verified: they can't be written after it
+  uint32_t start = micros();
+  bool result;
+
+  lockCurrent = ! ispFuseMismatch(ISP_FUSE_LOCK, lockBits);
+  if (! lockCurrent)
+    ispWriteFuse(ISP_FUSE_LOCK, lockBits);
+  result = ispVerifyFuse(ISP_FUSE_LOCK, lockBits);
+  phaseTime[PHASE_FUSES] += micros() - start;
   return result;
 }
 
-static bool dumpEeprom(PGM_P fileName) {
+static uint32_t hexDumpSize(uint32_t size) { // Upper bound, every record written
+  return size / HEX_RECORD_SIZE * (13 + 2 * HEX_RECORD_SIZE) + (size >> 16) * (13 + 2 * 2) + 13;
+}
+
+static bool dumpMemory(PGM_P fileName, PGM_P binName, avimemory_t memory, uint32_t size) {
+  uint32_t start = micros();
   char name[13];
   bool result = false;
 
   strcpy_P(name, fileName);
-  f = SD.open(name, O_WRITE | O_CREAT | O_TRUNC);
+  f = sdOpen(name, O_WRITE | O_CREAT | O_TRUNC);
   if (f) {
 #ifdef USE_HEAP
     uint8_t *data;
 #else
-    uint8_t data[HEX_PAGE_SIZE];
+    uint8_t data[HEX_RECORD_SIZE];
+#endif
+#ifdef DUMP_BIN
+    File bin;
+    aviheader_t header;
+    uint32_t crc = CRC32_INIT;
+    bool binOk = true;
 #endif
 
 #ifdef USE_HEAP
-    data = new uint8_t[HEX_PAGE_SIZE];
+    data = new uint8_t[HEX_RECORD_SIZE];
     if (data) {
 #endif
-      for (uint16_t addr = 0; addr < EEPROM_SIZE; addr += HEX_PAGE_SIZE) {
-        uint8_t len;
-
-        for (uint8_t i = 0; i < HEX_PAGE_SIZE; ++i) {
-          data[i] = ispReadEeprom(addr + i);
-        }
-        len = dataLength(data, HEX_PAGE_SIZE);
-        if (len) {
-          uint8_t crc;
-
-          crc = len + (addr / 256) + (addr & 0xFF);
-          for (uint8_t i = 0; i < len; ++i) {
-            crc += data[i];
+      hexOpen();
+#ifdef USE_HEAP
+      if (hexBuffer) {
+#endif
+        hexWriteOk = true;
+        sdReserve(f, hexDumpSize(size));
+#ifdef DUMP_BIN
+        if (binName)
+          binOk = createBin(bin, binName, header, memory, size, memory == AVI_FLASH ? ispFlashPageBytes() : ispDevice.eepromPageSize);
+#endif
+        for (uint32_t addr = 0; addr < size; addr += HEX_RECORD_SIZE) {
+          if (addr && (! (uint16_t)addr)) { // Next 64K window
+            data[0] = addr >> 24;
+            data[1] = addr >> 16;
+            hexPutRecord(0, HEX_EXTADDR, data, 2);
           }
-          f.print(':');
-          f.print(hex(name, len));
-          f.print(hex(name, addr / 256));
-          f.print(hex(name, addr));
-          f.print(F("00"));
-          for (uint8_t i = 0; i < len; ++i) {
-            f.print(hex(name, data[i]));
+          for (uint8_t i = 0; i < HEX_RECORD_SIZE; ++i) {
+            data[i] = memory == AVI_FLASH ? ispReadFlash(addr + i) : ispReadEeprom(addr + i);
           }
-          f.println(hex(name, 0 - crc));
+#ifdef DUMP_BIN
+          if (bin) {
+            crc = crc32Update(crc, data, HEX_RECORD_SIZE);
+            binOk = binOk && (bin.write(data, HEX_RECORD_SIZE) == HEX_RECORD_SIZE);
+          }
+#endif
+          if (dataLength(data, HEX_RECORD_SIZE))
+            hexPutRecord(addr, HEX_BIN, data, dataLength(data, HEX_RECORD_SIZE));
+          if (! (addr % (memory == AVI_FLASH ? 1024 : 128)))
+            printPercent(addr * 100 / size);
         }
-        if (! (addr % 128))
-          printPercent((uint32_t)addr * 100 / EEPROM_SIZE);
-      }
+        hexPutRecord(0, HEX_END, nullptr, 0);
+        hexFlush();
+        result = hexWriteOk && sdTrim(f);
+#ifdef DUMP_BIN
+        if (bin)
+          binOk = closeBin(bin, header, crc) && binOk;
+        result = result && binOk;
+#endif
+        if (result)
+          Serial.println(FPSTR(FAIL_OR_OK[1]));
 #ifdef USE_HEAP
-      delete[] data;
+      }
 #endif
-      f.println(F(":00000001FF"));
-      result = true;
-      Serial.println(FPSTR(FAIL_OR_OK[1]));
+      hexClose();
 #ifdef USE_HEAP
+      delete[] data;
     }
 #endif
     f.close();
   }
+  phaseTime[PHASE_DUMP] += micros() - start;
   return result;
 }
 
+static bool dumpEeprom(PGM_P fileName, PGM_P binName = nullptr) {
+  return dumpMemory(fileName, binName, AVI_EEPROM, ispDevice.eepromSize);
+}
+
+static bool dumpFlash(PGM_P fileName, PGM_P binName = nullptr) {
+  return dumpMemory(fileName, binName, AVI_FLASH, ispApplicationSize()); // Boot section is left out
+}
+
+/*
+ * EEPROM pages start from the current target content, so bytes missing from
+ * the image are kept and pages the image doesn't change are never written.
+ * A page the gang slots don't agree on is always written, its bytes missing
+ * from the image come from the first slot.
+ */
+static bool readEepromPage(uint16_t pageAddr, uint8_t *page) { // False if the slots differ
+  bool same = true;
+
+  for (uint8_t i = 0; i < ispDevice.eepromPageSize; ++i) {
+    page[i] = ispReadEeprom(pageAddr + i);
+    same = same && (! ispMismatch(page[i]));
+  }
+  return same;
+}
+
+#ifdef USE_AVI
+static bool programEepromImage() {
+  aviheader_t header;
+  uint8_t data[EEPROM_PAGE_SIZE_MAX], page[EEPROM_PAGE_SIZE_MAX];
+  bool ok;
+
+  ok = readImageHeader(header, AVI_EEPROM, ispDevice.eepromPageSize, ispDevice.eepromSize);
+  if (! ok)
+    Serial.println(FPSTR(WRONG_IMAGE));
+  else
+    ok = checkImage(header, nullptr, data, ispDevice.eepromPageSize);
+  for (uint32_t addr = header.base; ok && (addr < header.base + header.length); addr += ispDevice.eepromPageSize) {
+    if (sdRead(data, ispDevice.eepromPageSize) != ispDevice.eepromPageSize) {
+      Serial.println(FPSTR(IMAGE_READ_ERROR));
+      ok = false;
+    } else {
+      if ((! readEepromPage(addr, page)) || memcmp(page, data, ispDevice.eepromPageSize)) {
+        eepromCurrent = false;
+        if (! ispWriteEepromPage(addr, data, true)) {
+          Serial.println(FPSTR(EEPROM_WRITE_ERROR));
+          ok = false;
+        }
+      }
+    }
+    taskYield();
+  }
+  return ok;
+}
+#endif
+
+/*
+ * Bytes are merged into the current EEPROM page, which is written and verified
+ * only if it changed, once a byte falls into another page or on flush.
+ */
+struct eeprompage_t {
+  uint8_t data[EEPROM_PAGE_SIZE_MAX];
+  uint16_t addr;
+  bool dirty;
+};
+
+static void eepromBegin(eeprompage_t &page) {
+  page.addr = 0xFFFF;
+  page.dirty = false;
+}
+
+static bool eepromFlush(eeprompage_t &page) {
+  if (page.dirty && (! ispWriteEepromPage(page.addr, page.data, true))) {
+    Serial.println(FPSTR(EEPROM_WRITE_ERROR));
+    return false;
+  }
+  if (page.dirty)
+    eepromCurrent = false;
+  page.dirty = false;
+  return true;
+}
+
+static bool eepromPut(eeprompage_t &page, uint16_t addr, const uint8_t *data, uint8_t len) {
+  for (uint8_t i = 0; i < len; ++i, ++addr) {
+    if ((addr & ~(ispDevice.eepromPageSize - 1)) != page.addr) {
+      if (! eepromFlush(page))
+        return false;
+      page.addr = addr & ~(ispDevice.eepromPageSize - 1);
+      page.dirty = ! readEepromPage(page.addr, page.data);
+    }
+    if (page.data[addr & (ispDevice.eepromPageSize - 1)] != data[i]) {
+      page.data[addr & (ispDevice.eepromPageSize - 1)] = data[i];
+      page.dirty = true;
+    }
+  }
+  return true;
+}
+
 static bool programEeprom(PGM_P fileName) {
   char name[13];
   bool result = false;
 
+  eepromCurrent = true; // Until a page is written
   strcpy_P(name, fileName);
-  f = SD.open(name, O_READ);
+  f = sdOpen(name, O_READ);
   if (f) {
+#ifdef USE_AVI
+    if (f.peek() != ':')
+      result = programEepromImage();
+    else {
+#endif
 #ifdef USE_HEAP
     uint8_t *data;
 #else
     uint8_t data[HEX_PAGE_SIZE];
 #endif
-    uint16_t addr;
+    eeprompage_t page;
+    uint32_t addr;
     hexparse_t parse;
     hextype_t type;
     uint8_t len;
@@ -382,247 +983,1110 @@ static bool programEeprom(PGM_P fileName) {
     data = new uint8_t[HEX_PAGE_SIZE];
     if (data) {
 #endif
+      eepromBegin(page);
+      hexOpen();
       do {
         parse = parseHexLine(len, addr, type, data);
         if ((ok = (parse == HEX_OK))) {
           if (type == HEX_BIN) {
-            if (addr + len <= EEPROM_SIZE) {
-              for (uint8_t i = 0; i < len; ++i) {
-                if (! ispWriteEeprom(addr + i, data[i], true)) {
-                  Serial.println(F("\r\nEEPROM write error!"));
-                  ok = false;
-                  break;
-                }
-              }
-            } else {
+            if (addr + len <= ispDevice.eepromSize)
+              ok = eepromPut(page, addr, data, len);
+            else {
               Serial.print(FPSTR(HEX_LINE_HAS));
               Serial.println(F("wrong EEPROM address!"));
               ok = false;
             }
           } else if (type == HEX_END) {
-            if ((len == 0) && (addr == 0))
+            if ((len == 0) && (addr == 0)) {
+              ok = eepromFlush(page);
               break;
-            else {
+            } else {
               Serial.print(FPSTR(HEX_LINE_HAS));
               Serial.println(F("wrong END!"));
               ok = false;
             }
-          } else {
-            Serial.print(FPSTR(HEX_LINE_HAS));
-            Serial.println(F("unexpected type!"));
-            ok = false;
           }
-          digitalWrite(LED2_PIN, LED_LEVEL == (millis() % 500 < BLINK_TIME));
+          taskYield();
         } else {
           printParseError(parse);
         }
       } while (ok);
+      hexClose();
 #ifdef USE_HEAP
       delete[] data;
 #endif
-      digitalWrite(LED2_PIN, ! LED_LEVEL);
       result = ok;
 #ifdef USE_HEAP
     }
+#endif
+#ifdef USE_AVI
+    }
 #endif
     f.close();
   }
   return result;
 }
 
-static bool dumpFlash(PGM_P fileName) {
-  char name[13];
-  bool result = false;
+/*
+ * serial.txt: the first line "N:XXXXXXXX" holds the next unit number in hex,
+ * each following line "AAAA:TT.." puts a field of up to 16 bytes at EEPROM
+ * address AAAA. Field bytes are hex, "SS" pairs take the low bytes of the
+ * unit number MSB first and "ss" pairs LSB first, e.g. "0020:02AB1CSSSSSS"
+ * for a MAC address. Fields end at the first empty line. The number on SD is
+ * advanced in place before the EEPROM is touched, so a failed unit wastes a
+ * number but two units never get the same one.
+ */
+static bool reserveUnitNumber(char *str, uint8_t size) {
+  uint8_t b;
 
-  strcpy_P(name, fileName);
-  f = SD.open(name, O_WRITE | O_CREAT | O_TRUNC);
-  if (f) {
-#ifdef USE_HEAP
-    uint8_t *data;
-#else
-    uint8_t data[HEX_PAGE_SIZE];
-#endif
-    uint16_t flashTail;
-    uint8_t len;
+  if ((freadUntil(str, size, '\n', '\r') != 10) || strncmp_P(str, PSTR("N:"), 2))
+    return false;
+  unitNumber = 0;
+  for (uint8_t i = 0; i < 4; ++i) {
+    if (! parseHexNum(&str[2 + i * 2], b))
+      return false;
+    unitNumber = (unitNumber << 8) | b;
+  }
+  for (uint8_t i = 0; i < 4; ++i) {
+    hex(&str[i * 2], (unitNumber + 1) >> (24 - i * 8));
+  }
+  if ((! f.seek(2)) || (f.write((const uint8_t*)str, 8) != 8))
+    return false;
+  f.flush();
+  unitNumbered = true;
+  return true;
+}
 
-#ifdef USE_HEAP
-    data = new uint8_t[HEX_PAGE_SIZE];
-    if (data) {
-#endif
-      len = ispReadHighFuseBits() & 0x07;
-      if (len & 0x01) // BOOTRST not set
-        flashTail = FLASH_SIZE;
-      else {
-        if (len == 0x06)
-          flashTail = 0x3F00;
-        else if (len == 0x04)
-          flashTail = 0x3E00;
-        else if (len == 0x02)
-          flashTail = 0x3C00;
-        else // if (len == 0x00)
-          flashTail = 0x3800;
+static bool burnSerialFields(char *str, uint8_t size) {
+  eeprompage_t page;
+  uint8_t len;
+
+  eepromBegin(page);
+  while ((len = freadUntil(str, size, '\n', '\r'))) {
+    uint8_t hi, lo, msb = 0, lsb = 0;
+    uint16_t addr;
+
+    if ((len < 7) || (len == size - 1) || (! (len & 0x01)) || (str[4] != ':') ||
+      (! parseHexNum(str, hi)) || (! parseHexNum(&str[2], lo))) {
+      Serial.println(F("\r\nWrong serial field!"));
+      return false;
+    }
+    addr = (hi << 8) | lo;
+    len = (len - 5) / 2;
+    for (uint8_t i = 0; i < len; ++i) {
+      msb += (str[5 + i * 2] == 'S') && (str[6 + i * 2] == 'S');
+      lsb += (str[5 + i * 2] == 's') && (str[6 + i * 2] == 's');
+    }
+    if ((msb > sizeof(unitNumber)) || (lsb > sizeof(unitNumber))) {
+      Serial.println(F("\r\nWrong serial field!"));
+      return false;
+    }
+    lsb = 0;
+    for (uint8_t i = 0; i < len; ++i) { // Decoded in place, str[i] is behind the pair being read
+      const char *pair = &str[5 + i * 2];
+
+      if ((pair[0] == 'S') && (pair[1] == 'S'))
+        str[i] = unitNumber >> (8 * --msb);
+      else if ((pair[0] == 's') && (pair[1] == 's'))
+        str[i] = unitNumber >> (8 * lsb++);
+      else if (! parseHexNum(pair, lo)) {
+        Serial.println(F("\r\nWrong serial field!"));
+        return false;
+      } else
+        str[i] = lo;
+    }
+    if (addr + len > ispDevice.eepromSize) {
+      Serial.println(F("\r\nWrong serial field address!"));
+      return false;
+    }
+    if (! eepromPut(page, addr, (const uint8_t*)str, len))
+      return false;
+  }
+  return eepromFlush(page);
+}
+
+static bool programSerial(PGM_P fileName) {
+  constexpr uint8_t STR_SIZE = 39; // "AAAA:" and 16 bytes, a longer line fills it up
+
+  char name[13];
+  bool result = false;
+
+  unitNumbered = false;
+  strcpy_P(name, fileName);
+  f = sdOpen(name, O_RDWR);
+  if (f) {
+#ifdef USE_HEAP
+    char *str;
+#else
+    char str[STR_SIZE];
+#endif
+
+#ifdef USE_HEAP
+    str = new char[STR_SIZE];
+    if (str) {
+#endif
+      hexOpen();
+      result = reserveUnitNumber(str, STR_SIZE);
+      if (result) {
+        hexRewind();
+        freadUntil(str, STR_SIZE, '\n', '\r'); // Number line
+        result = burnSerialFields(str, STR_SIZE);
       }
-      for (uint16_t addr = 0; addr < flashTail; addr += HEX_PAGE_SIZE) {
-        for (uint8_t i = 0; i < HEX_PAGE_SIZE; ++i) {
-          data[i] = ispReadFlash(addr + i);
+      hexClose();
+#ifdef USE_HEAP
+      delete[] str;
+    }
+#endif
+    f.close();
+  }
+  return result;
+}
+
+/*
+ * Flash burn pipeline: a page is loaded and its write started, then parsing of
+ * the next page from SD runs while the target is busy. The target accepts no
+ * commands but RDY/BSY polls during a write, so the wait and read-back verify
+ * of the previous page happen right before the next page is loaded.
+ */
+struct flashpipe_t {
+  uint8_t *page; // Being assembled
+  uint8_t *busyPage; // Being written by the target
+  uint32_t pageAddr, busyAddr;
+  uint32_t busySince;
+  uint16_t queued; // Pages written
+  bool busyVerify; // Read back busyPage even if it is not the last one
+};
+
+static void beginFlashPipe(flashpipe_t &pipe, uint8_t *pages) {
+  pipe.page = pages;
+  pipe.busyPage = &pages[ispFlashPageBytes()];
+  pipe.pageAddr = 0xFFFFFFFF;
+  pipe.busyAddr = 0xFFFFFFFF;
+  pipe.busySince = 0;
+  pipe.queued = 0;
+}
+
+static bool finishFlashPage(flashpipe_t &pipe, bool last = true) {
+  bool result = true;
+
+  if (pipe.busyAddr != 0xFFFFFFFF) {
+    result = ispWait(ISP_WAIT_FLASH, pipe.busySince);
+    if (result && (pipe.busyVerify || (last && (VERIFY_POLICY == VERIFY_SAMPLED))))
+      result = ispVerifyFlashPage(pipe.busyAddr, pipe.busyPage);
+    pipe.busyAddr = 0xFFFFFFFF;
+  }
+  return result;
+}
+
+static bool queueFlashPage(flashpipe_t &pipe) {
+  uint8_t *p;
+
+  if (! dataLength(pipe.page, ispFlashPageBytes())) // Still erased
+    return true;
+  if (! finishFlashPage(pipe, false))
+    return false;
+  ispLoadFlashPage(pipe.page);
+  ispCommitFlashPage(pipe.pageAddr);
+  pipe.busySince = micros();
+  pipe.busyAddr = pipe.pageAddr;
+  pipe.busyVerify = (VERIFY_POLICY == VERIFY_PAGE) ||
+    ((VERIFY_POLICY == VERIFY_SAMPLED) && ((! pipe.queued) || (! random(VERIFY_SAMPLE_RATE))));
+  ++pipe.queued;
+  p = pipe.busyPage;
+  pipe.busyPage = pipe.page;
+  pipe.page = p;
+  return true;
+}
+
+static bool verifyFlashPage(flashpipe_t &pipe) { // Sink of the VERIFY_DEFERRED pass, skips pages queueFlashPage() skips
+  return (! dataLength(pipe.page, ispFlashPageBytes())) || ispVerifyFlashPage(pipe.pageAddr, pipe.page);
+}
+
+typedef bool (*pagesink_t)(flashpipe_t &pipe); // Takes pipe.page at pipe.pageAddr
+
+static inline bool bitmapGet(const uint8_t *map, uint16_t bit) {
+  return map[bit / 8] & (1 << (bit & 0x07));
+}
+
+static inline void bitmapSet(uint8_t *map, uint16_t bit) {
+  map[bit / 8] |= 1 << (bit & 0x07);
+}
+
+static uint16_t bitmapCount(const uint8_t *map, uint16_t bits) { // Set bits below bits
+  uint16_t result = 0;
+
+  for (uint16_t bit = 0; bit < bits; ++bit) {
+    if (bitmapGet(map, bit))
+      ++result;
+  }
+  return result;
+}
+
+/*
+ * Differential programming: erase and burn are skipped when the target flash
+ * already holds the image, present pages matching their image CRC and the
+ * others erased. The first and last present pages are compared first, builds
+ * differ there most often, so a board needing a burn is found out early.
+ * Pages are read from the lead slot only, so gang mode always burns.
+ */
+typedef bool (*pagecrc_t)(uint16_t slot, uint8_t *buf, uint32_t &crc); // Image CRC of a present page by its slot
+
+static bool flashPageCurrent(uint16_t page, uint8_t *buf, const uint32_t *crc) { // Erased if no crc
+  ispReadFlashPage((uint32_t)page * ispFlashPageBytes(), buf);
+  if (crc)
+    return ~crc32Update(CRC32_INIT, buf, ispFlashPageBytes()) == *crc;
+  return ! dataLength(buf, ispFlashPageBytes());
+}
+
+static uint32_t waitEstimate(ispwait_t op) { // us, last measured or worst case
+  if (ispBusyTime[op] && (ispBusyTime[op] != 0xFFFF))
+    return ispBusyTime[op];
+  return ispDevice.wait[op] * 100UL;
+}
+
+static bool targetFlashCurrent(const uint8_t *map, pagecrc_t pageCrc, uint8_t *buf) {
+  uint32_t start = micros(), crc, burn;
+  uint16_t first = ispDevice.flashPages, last = 0, present = 0;
+
+  for (uint16_t page = 0; page < ispDevice.flashPages; ++page) {
+    if (bitmapGet(map, page)) {
+      if (first == ispDevice.flashPages)
+        first = page;
+      last = page;
+      ++present;
+    }
+  }
+  for (uint8_t pass = 0; pass < 3; ++pass) { // Ends, other present pages, erased pages
+    uint16_t slot = 0;
+
+    for (uint16_t page = 0; page < ispDevice.flashPages; ++page) {
+      if (bitmapGet(map, page)) {
+        if ((pass < 2) && (((page == first) || (page == last)) == (pass == 0)) &&
+          ((! pageCrc(slot, buf, crc)) || (! flashPageCurrent(page, buf, &crc))))
+          return false;
+        ++slot;
+      } else if ((pass == 2) && (! flashPageCurrent(page, buf, nullptr)))
+        return false;
+      taskYield();
+    }
+  }
+  start = micros() - start;
+  burn = (start / ispDevice.flashPages) * ((VERIFY_POLICY == VERIFY_PAGE) || (VERIFY_POLICY == VERIFY_DEFERRED) ? 2 : 1); // Page load is as long as a read
+  burn = waitEstimate(ISP_WAIT_ERASE) + present * (burn + waitEstimate(ISP_WAIT_FLASH));
+  flashSaved = burn > start ? burn - start : 0;
+  return true;
+}
+
+#ifdef USE_AVI
+static bool imagePageCrc(uint16_t slot, uint8_t *buf, uint32_t &crc) {
+  if ((! f.seek(sizeof(aviheader_t) + (uint32_t)slot * ispFlashPageBytes())) || (sdRead(buf, ispFlashPageBytes()) != ispFlashPageBytes()))
+    return false;
+  crc = ~crc32Update(CRC32_INIT, buf, ispFlashPageBytes());
+  return true;
+}
+
+static bool programFlashImage() {
+  aviheader_t header;
+#ifdef USE_HEAP
+  uint8_t *pages;
+#else
+  uint8_t pages[FLASH_PAGE_SIZE_MAX * 2 * 2 + sizeof(avilz_t) + IMAGE_LZ_BUFFER];
+#endif
+  avilz_t *lz = nullptr;
+  flashpipe_t pipe;
+  bool ok = false;
+
+  if (! readImageHeader(header, AVI_FLASH, ispFlashPageBytes(), ispFlashSize())) {
+    Serial.println(FPSTR(WRONG_IMAGE));
+    return false;
+  }
+  flashSource = header.flags & AVI_FLAG_LZ ? SOURCE_LZ : SOURCE_AVI;
+#ifdef USE_HEAP
+  pages = new uint8_t[ispFlashPageBytes() * 2 + (flashSource == SOURCE_LZ ? sizeof(avilz_t) + IMAGE_LZ_BUFFER : 0)]; // 582 bytes packed on a 328P
+  if (pages) {
+#endif
+    beginFlashPipe(pipe, pages);
+    ok = true;
+    if (flashSource == SOURCE_LZ) { // Pages only come in order, so no differential programming
+      lz = (avilz_t*)(pages + ispFlashPageBytes() * 2);
+      lzInput = pages + ispFlashPageBytes() * 2 + sizeof(avilz_t);
+      hexBytes = hexReadTime = hexParseTime = 0;
+    } else {
+#ifndef ISP_GANG
+      memset(pipe.busyPage, 0, ispDevice.flashPages / 8); // Present page map, never larger than a page
+      for (uint32_t addr = header.base; addr < header.base + header.length; addr += ispFlashPageBytes()) {
+        bitmapSet(pipe.busyPage, addr / ispFlashPageBytes());
+      }
+      flashCurrent = targetFlashCurrent(pipe.busyPage, imagePageCrc, pipe.page);
+#endif
+    }
+    if (ok && (! flashCurrent))
+      ok = checkImage(header, lz, pipe.page, ispFlashPageBytes());
+    if (ok && (! flashCurrent)) {
+      ok = ispChipErase();
+      if (! ok)
+        Serial.println(FPSTR(CHIP_ERASE_ERROR));
+    }
+    for (uint32_t addr = header.base; ok && (! flashCurrent) && (addr < header.base + header.length); addr += ispFlashPageBytes()) {
+      if (! readImagePage(lz, pipe.page, ispFlashPageBytes())) {
+        Serial.println(FPSTR(IMAGE_READ_ERROR));
+        ok = false;
+      } else {
+        pipe.pageAddr = addr;
+        if (! queueFlashPage(pipe)) {
+          Serial.println(FPSTR(FLASH_WRITE_ERROR));
+          ok = false;
         }
-        len = dataLength(data, HEX_PAGE_SIZE);
-        if (len) {
-          uint8_t crc;
+      }
+      taskYield();
+    }
+    if (ok && (! finishFlashPage(pipe))) {
+      Serial.println(FPSTR(FLASH_WRITE_ERROR));
+      ok = false;
+    }
+    if (ok && (! flashCurrent) && (VERIFY_POLICY == VERIFY_DEFERRED)) {
+      verifypass_t pass;
 
-          crc = len + (addr / 256) + (addr & 0xFF);
-          for (uint8_t i = 0; i < len; ++i) {
-            crc += data[i];
-          }
-          f.print(':');
-          f.print(hex(name, len));
-          f.print(hex(name, addr / 256));
-          f.print(hex(name, addr));
-          f.print(F("00"));
-          for (uint8_t i = 0; i < len; ++i) {
-            f.print(hex(name, data[i]));
-          }
-          f.println(hex(name, 0 - crc));
+      beginVerifyPass(pass);
+      ok = rewindImage(lz);
+      for (pipe.pageAddr = header.base; ok && (pipe.pageAddr < header.base + header.length); pipe.pageAddr += ispFlashPageBytes()) {
+        ok = readImagePage(lz, pipe.page, ispFlashPageBytes()) && verifyFlashPage(pipe);
+      }
+      endVerifyPass(pass);
+      if (! ok)
+        Serial.println(FPSTR(FLASH_VERIFY_ERROR));
+    }
+    if (lz)
+      hexBookTimes();
+#ifdef USE_HEAP
+    delete[] pages;
+  }
+#endif
+  return ok;
+}
+#endif
+
+/*
+ * First pass over the HEX file: validates every record before anything is
+ * erased and maps the pages it touches. A page whose records are not
+ * contiguous in the file is marked split. Only split outlives the scan, so
+ * seen may borrow the page buffers.
+ */
+static bool scanFlashHex(uint8_t *data, uint8_t *seen, uint8_t *split) {
+  hexparse_t parse;
+  hextype_t type;
+  uint32_t addr;
+  uint16_t page, pageBytes = ispFlashPageBytes();
+  uint8_t len;
+
+  memset(seen, 0, ispDevice.flashPages / 8);
+  memset(split, 0, ispDevice.flashPages / 8);
+  page = 0xFFFF;
+  for (;;) {
+    parse = parseHexLine(len, addr, type, data);
+    if (parse != HEX_OK) {
+      printParseError(parse);
+      return false;
+    }
+    if (type == HEX_BIN) {
+      if (addr + len > ispFlashSize()) {
+        Serial.print(FPSTR(HEX_LINE_HAS));
+        Serial.println(F("wrong flash address!"));
+        return false;
+      }
+      for (uint8_t i = 0; i < len; ++i) {
+        if ((addr + i) / pageBytes != page) {
+          page = (addr + i) / pageBytes;
+          if (bitmapGet(seen, page))
+            bitmapSet(split, page);
+          bitmapSet(seen, page);
         }
-        if (! (addr % 1024))
-          printPercent((uint32_t)addr * 100 / flashTail);
       }
+    } else if (type == HEX_END) {
+      if ((len == 0) && (addr == 0))
+        return true;
+      Serial.print(FPSTR(HEX_LINE_HAS));
+      Serial.println(F("wrong END!"));
+      return false;
+    }
+  }
+}
+
+/*
+ * Burning pass over the HEX file. With only == 0xFFFF pages are burned as
+ * the records leave them and split pages are skipped, otherwise just page
+ * number only is collected from the whole file and burned at the end, so
+ * every page is written exactly once.
+ */
+static bool burnFlashHex(flashpipe_t &pipe, uint8_t *data, const uint8_t *split, uint16_t only, pagesink_t sink = queueFlashPage) {
+  hexparse_t parse;
+  hextype_t type;
+  uint32_t addr;
+  uint16_t pageBytes = ispFlashPageBytes();
+  uint8_t len;
+  bool take = false, ok = true;
+
+  hexRewind();
+  if (only != 0xFFFF) {
+    pipe.pageAddr = (uint32_t)only * pageBytes;
+    memset(pipe.page, 0xFF, pageBytes);
+  } else
+    pipe.pageAddr = 0xFFFFFFFF;
+  while (ok) {
+    parse = parseHexLine(len, addr, type, data);
+    if (parse != HEX_OK) {
+      printParseError(parse);
+      return false;
+    }
+    if (type == HEX_BIN) {
+      for (uint8_t i = 0; ok && (i < len); ++i) {
+        uint32_t a = addr + i;
+
+        if (only == 0xFFFF) {
+          if ((a & ~(uint32_t)(pageBytes - 1)) != pipe.pageAddr) {
+            if (take)
+              ok = sink(pipe);
+            pipe.pageAddr = a & ~(uint32_t)(pageBytes - 1);
+            take = ! bitmapGet(split, pipe.pageAddr / pageBytes);
+            if (take)
+              memset(pipe.page, 0xFF, pageBytes);
+          }
+          if (take)
+            pipe.page[a & (pageBytes - 1)] = data[i];
+        } else if ((a & ~(uint32_t)(pageBytes - 1)) == pipe.pageAddr)
+          pipe.page[a & (pageBytes - 1)] = data[i];
+      }
+    } else if (type == HEX_END) {
+      if ((only != 0xFFFF) || take)
+        ok = sink(pipe);
+      break;
+    }
+    taskYield();
+  }
+  if ((! ok) && (sink == queueFlashPage))
+    Serial.println(FPSTR(FLASH_WRITE_ERROR));
+  else if ((! ok) && (sink == verifyFlashPage))
+    Serial.println(FPSTR(FLASH_VERIFY_ERROR));
+  return ok;
+}
+
+/*
+ * Pages of every pass over the HEX file, split pages included. Passes run in
+ * file order, so they are written to the cache in place by their slot, the
+ * number of present pages below them.
+ */
+static bool burnFlashHexPages(flashpipe_t &pipe, uint8_t *data, const uint8_t *split, pagesink_t sink = queueFlashPage) {
+  bool ok;
+
+  ok = burnFlashHex(pipe, data, split, 0xFFFF, sink);
+  for (uint16_t page = 0; ok && (page < ispDevice.flashPages); ++page) {
+    if (bitmapGet(split, page))
+      ok = burnFlashHex(pipe, data, split, page, sink);
+  }
+  return ok;
+}
+
+#ifdef PRODUCTION
+/*
+ * Scan result of the first pass, kept for the next targets. The file is
+ * assumed unchanged while its size and the device match, reset the
+ * programmer after swapping the card.
+ */
+struct hexscan_t {
+  uint8_t signature[3];
+  uint32_t size; // 0 if nothing is kept
+  uint8_t split[FLASH_PAGES_MAX / 8];
+};
+
+static hexscan_t hexScan;
+
+static bool scanFlashHexOnce(uint8_t *data, uint8_t *seen) {
+  if (hexScan.size && (hexScan.size == f.size()) && (! memcmp(hexScan.signature, ispDevice.signature, sizeof(hexScan.signature))))
+    return true;
+  hexScan.size = 0;
+  if (! scanFlashHex(data, seen, hexScan.split))
+    return false;
+  memcpy(hexScan.signature, ispDevice.signature, sizeof(hexScan.signature));
+  hexScan.size = f.size();
+  return true;
+}
+#endif
+
+static bool programFlashHex() {
 #ifdef USE_HEAP
-      delete[] data;
+  uint8_t *pages, *data;
+#else
+  uint8_t pages[FLASH_PAGE_SIZE_MAX * 2 * 2], data[HEX_PAGE_SIZE + FLASH_PAGES_MAX / 8];
 #endif
-      f.println(F(":00000001FF"));
-      result = true;
-      Serial.println(FPSTR(FAIL_OR_OK[1]));
+  flashpipe_t pipe;
+  uint8_t *seen, *split;
+  bool ok = false;
+
 #ifdef USE_HEAP
+  pages = new uint8_t[ispFlashPageBytes() * 2];
+  if (pages) {
+#ifdef PRODUCTION
+    data = new uint8_t[HEX_PAGE_SIZE]; // Split page map is in hexScan
+#else
+    data = new uint8_t[HEX_PAGE_SIZE + ispDevice.flashPages / 8]; // Record data, then split page map
+#endif
+    if (data) {
+#endif
+      seen = pages; // Free until the pipe starts
+      hexOpen();
+#ifdef PRODUCTION
+      split = hexScan.split;
+      ok = scanFlashHexOnce(data, seen);
+#else
+      split = &data[HEX_PAGE_SIZE];
+      ok = scanFlashHex(data, seen, split);
+#endif
+      if (ok) {
+        ok = ispChipErase();
+        if (! ok)
+          Serial.println(FPSTR(CHIP_ERASE_ERROR));
+      }
+      if (ok) {
+        beginFlashPipe(pipe, pages);
+        ok = burnFlashHexPages(pipe, data, split);
+        if (ok && (! finishFlashPage(pipe))) {
+          Serial.println(FPSTR(FLASH_WRITE_ERROR));
+          ok = false;
+        }
+        if (ok && (VERIFY_POLICY == VERIFY_DEFERRED)) {
+          verifypass_t pass;
+
+          beginVerifyPass(pass);
+          ok = burnFlashHexPages(pipe, data, split, verifyFlashPage);
+          endVerifyPass(pass);
+        }
+      }
+      hexClose();
+#ifdef USE_HEAP
+      delete[] data;
     }
+    delete[] pages;
+  }
 #endif
-    f.close();
+  return ok;
+}
+
+#ifdef USE_CACHE
+static File cacheFile;
+static const uint8_t *cacheMap; // Present pages
+static uint32_t cacheTable, cachePayload;
+static uint16_t cacheSlotPage, cacheSlot; // Slot of cacheSlotPage, counted from the last page cached
+#ifdef PRODUCTION
+static avicache_t cacheSource; // Last HEX found cached, its text is not hashed again while the size matches
+#endif
+
+static uint16_t cacheSlotOf(uint16_t page) { // Pages mostly come in address order
+  while (cacheSlotPage < page)
+    cacheSlot += bitmapGet(cacheMap, cacheSlotPage++);
+  while (cacheSlotPage > page)
+    cacheSlot -= bitmapGet(cacheMap, --cacheSlotPage);
+  return cacheSlot;
+}
+
+static bool cachePage(flashpipe_t &pipe) {
+  uint16_t pageBytes = ispFlashPageBytes(), slot;
+  uint32_t crc;
+
+  slot = cacheSlotOf(pipe.pageAddr / pageBytes);
+  crc = ~crc32Update(CRC32_INIT, pipe.page, pageBytes);
+  return cacheFile.seek(cacheTable + slot * sizeof(crc)) && (cacheFile.write((const uint8_t*)&crc, sizeof(crc)) == sizeof(crc)) &&
+    cacheFile.seek(cachePayload + (uint32_t)slot * pageBytes) && (cacheFile.write(pipe.page, pageBytes) == pageBytes);
+}
+
+static bool fillCache(uint8_t *buf, uint16_t size, uint8_t value, uint32_t len) { // Grows the file, it can only be written in place up to its end
+  memset(buf, value, size);
+  while (len) {
+    uint16_t chunk = len < size ? len : size;
+
+    if (cacheFile.write(buf, chunk) != chunk)
+      return false;
+    len -= chunk;
   }
-  return result;
+  return true;
 }
 
-static bool programFlash(PGM_P fileName) {
-  static const char FLASH_WRITE_ERROR[] PROGMEM = "\r\nFlash write error!";
+static bool cacheCrc(File &file, const avicache_t &key, uint8_t *buf, uint16_t size, uint32_t &crc) { // Of the key, map and table, file is left at the payload
+  uint32_t len;
 
-  char name[13];
-  bool result = false;
+  crc = CRC32_INIT;
+  if (! file.seek(sizeof(aviheader_t)))
+    return false;
+  for (len = aviCachePayload(key) - sizeof(aviheader_t); len; ) {
+    uint16_t chunk = len < size ? len : size;
 
-  strcpy_P(name, fileName);
-  f = SD.open(name, O_READ);
-  if (f) {
+    if (file.read(buf, chunk) != chunk)
+      return false;
+    crc = crc32Update(crc, buf, chunk);
+    len -= chunk;
+  }
+  crc = ~crc;
+  return true;
+}
+
+static bool readCacheKey(aviheader_t &header, avicache_t &key) { // From f, left at the present page bitmap
+  uint8_t buf[32];
+  uint32_t crc;
+
+  return (sdRead(&header, sizeof(header)) == sizeof(header)) && aviCheckHeader(header, ispDevice.signature, AVI_FLASH, ispFlashPageBytes(), ispFlashSize()) &&
+    (sdRead(&key, sizeof(key)) == sizeof(key)) && (key.pages == ispDevice.flashPages) &&
+    (header.length == (uint32_t)key.present * ispFlashPageBytes()) && (f.size() == aviCachePayload(key) + header.length) &&
+    cacheCrc(f, key, buf, sizeof(buf), crc) && (crc == header.crc) && f.seek(sizeof(header) + sizeof(key));
+}
+
+/*
+ * Builds the cache from the HEX file in f with the pipe as page buffer. The
+ * page being written by the target is never used, so busyPage holds the
+ * present page bitmap, which is never larger than a page.
+ */
+static bool buildFlashCache(const char *name, const avicache_t &source, uint8_t *pages, uint8_t *data, uint8_t *split, bool &cached) {
+  flashpipe_t pipe;
+  aviheader_t header;
+  avicache_t key = source;
+  uint16_t pageBytes = ispFlashPageBytes();
+  bool ok;
+
+  beginFlashPipe(pipe, pages);
+  hexRewind();
+  if (! scanFlashHex(data, pipe.busyPage, split))
+    return false;
+  cacheMap = pipe.busyPage;
+  key.pages = ispDevice.flashPages;
+  key.present = bitmapCount(cacheMap, key.pages);
+  cacheTable = aviCacheTable(key);
+  cachePayload = aviCachePayload(key);
+  aviInitHeader(header, ispDevice.signature, AVI_FLASH, 0, (uint32_t)key.present * pageBytes, pageBytes);
+  cacheFile = sdOpen(name, O_RDWR | O_CREAT | O_TRUNC);
+  if (cacheFile)
+    sdReserve(cacheFile, cachePayload + header.length); // Written in full by the fills below
+  ok = cacheFile && (cacheFile.write((const uint8_t*)&header, sizeof(header)) == sizeof(header)) &&
+    (cacheFile.write((const uint8_t*)&key, sizeof(key)) == sizeof(key)) && (cacheFile.write(cacheMap, key.pages / 8) == key.pages / 8) &&
+    fillCache(pipe.page, pageBytes, 0x00, cachePayload - cacheTable) && fillCache(pipe.page, pageBytes, 0xFF, header.length);
+  cacheSlotPage = cacheSlot = 0;
+  if (ok)
+    ok = burnFlashHexPages(pipe, data, split, cachePage); // The HEX file is valid after the scan
+  if (ok)
+    ok = cacheCrc(cacheFile, key, pipe.page, pageBytes, header.crc);
+  if (ok) {
+    ok = cacheFile.seek(0) && (cacheFile.write((const uint8_t*)&header, sizeof(header)) == sizeof(header));
+  }
+  if (cacheFile)
+    cacheFile.close();
+  if (! ok)
+    SD.remove(name);
+  cached = ok;
+  return true;
+}
+
+/*
+ * Makes the cache match the HEX file in f, keyed by its size and text CRC.
+ * False on HEX errors only, cached tells if the cache can be burned.
+ */
+static bool updateFlashCache(PGM_P cacheName, bool &cached) {
 #ifdef USE_HEAP
-    uint8_t *page, *data;
+  uint8_t *pages, *data;
 #else
-    uint8_t page[FLASH_PAGE_SIZE * 2], data[HEX_PAGE_SIZE];
+  uint8_t pages[FLASH_PAGE_SIZE_MAX * 2 * 2], data[HEX_PAGE_SIZE + FLASH_PAGES_MAX / 8];
 #endif
-    uint16_t pageAddr, addr;
-    hexparse_t parse;
-    hextype_t type;
-    uint8_t len;
-    bool ok;
+  char name[13];
+  avicache_t source, key;
+  aviheader_t header;
+  File hex = f;
+  bool result = true;
+
+  cached = false;
+  hexOpen();
+#ifdef USE_HEAP
+  if (! hexBuffer) {
+    hexClose();
+    return true;
+  }
+#endif
+  source.sourceSize = f.size();
+#ifdef PRODUCTION
+  if (cacheSource.sourceSize && (cacheSource.sourceSize == source.sourceSize))
+    source.sourceCrc = cacheSource.sourceCrc;
+  else {
+#endif
+    int16_t len;
 
+    source.sourceCrc = CRC32_INIT;
+    while ((len = sdRead(hexBuffer, HEX_BUFFER_SIZE)) > 0)
+      source.sourceCrc = crc32Update(source.sourceCrc, (const uint8_t*)hexBuffer, len);
+    source.sourceCrc = ~source.sourceCrc;
+#ifdef PRODUCTION
+  }
+#endif
+  strcpy_P(name, cacheName);
+  f = sdOpen(name, O_READ);
+  if (f) {
+    cached = readCacheKey(header, key) && (key.sourceSize == source.sourceSize) && (key.sourceCrc == source.sourceCrc);
+    f.close();
+  }
+  f = hex;
+  if (! cached) {
 #ifdef USE_HEAP
-    page = new uint8_t[FLASH_PAGE_SIZE * 2];
-    if (page) {
-      data = new uint8_t[HEX_PAGE_SIZE];
+    pages = new uint8_t[ispFlashPageBytes() * 2];
+    if (pages) {
+      data = new uint8_t[HEX_PAGE_SIZE + ispDevice.flashPages / 8]; // Record data, then split page map
       if (data) {
 #endif
-        pageAddr = 0xFFFF;
-        ispChipErase();
-        do {
-          parse = parseHexLine(len, addr, type, data);
-          if ((ok = (parse == HEX_OK))) {
-            if (type == HEX_EXTADDR) {
-              if ((len == 2) && (addr == 0)) {
-                ispCommand(0x4D, 0x00, data[1], 0x00);
-              } else {
-                Serial.print(FPSTR(HEX_LINE_HAS));
-                Serial.println(F("wrong EXTADDR!"));
-                ok = false;
-              }
-            } else if (type == HEX_BIN) {
-              if (addr + len <= FLASH_SIZE) {
-                if ((addr & 0xFF80) != pageAddr) {
-                  if (pageAddr != 0xFFFF) {
-                    if (! ispWriteFlashPage(pageAddr, page, true)) {
-                      Serial.println(FPSTR(FLASH_WRITE_ERROR));
-                      ok = false;
-                      break;
-                    }
-                  }
-                  pageAddr = addr & 0xFF80;
-                  memset(page, 0xFF, FLASH_PAGE_SIZE * 2);
-                }
-                for (uint8_t i = 0; i < len; ++i) {
-                  page[(addr + i) & 0x7F] = data[i];
-                }
-              } else {
-                Serial.print(FPSTR(HEX_LINE_HAS));
-                Serial.println(F("wrong flash address!"));
-                ok = false;
-              }
-            } else if (type == HEX_END) {
-              if ((len == 0) && (addr == 0)) {
-                if (pageAddr != 0xFFFF) {
-                  ok = ispWriteFlashPage(pageAddr, page, true);
-                  if (! ok)
-                    Serial.println(FPSTR(FLASH_WRITE_ERROR));
-                }
-                break;
-              } else {
-                Serial.print(FPSTR(HEX_LINE_HAS));
-                Serial.println(F("wrong END!"));
-                ok = false;
-              }
-            } else {
-              Serial.print(FPSTR(HEX_LINE_HAS));
-              Serial.println(F("unexpected type!"));
-              ok = false;
-            }
-            digitalWrite(LED2_PIN, LED_LEVEL == (millis() % 500 < BLINK_TIME));
-          } else {
-            printParseError(parse);
-          }
-        } while (ok);
+        result = buildFlashCache(name, source, pages, data, &data[HEX_PAGE_SIZE], cached);
+        if (result && (! cached))
+          Serial.println(FPSTR(CACHE_ERROR)); // Burned from the HEX file
 #ifdef USE_HEAP
         delete[] data;
+      }
+      delete[] pages;
+    }
+#endif
+  }
+#ifdef PRODUCTION
+  if (cached)
+    cacheSource = source;
 #endif
-        digitalWrite(LED2_PIN, ! LED_LEVEL);
-        result = ok;
+  hexClose();
+  return result;
+}
+
+/*
+ * Present pages are streamed from the cache and checked against their CRC
+ * before being burned, the table is read CACHE_CRC_CHUNK entries at a time.
+ */
+static bool streamFlashCache(flashpipe_t &pipe, const avicache_t &key, const uint8_t *map, pagesink_t sink) {
+  constexpr uint8_t CACHE_CRC_CHUNK = 8;
+
+  uint32_t crcs[CACHE_CRC_CHUNK];
+  uint16_t pageBytes = ispFlashPageBytes(), slot = 0;
+  bool ok = true;
+
+  for (uint16_t page = 0; ok && (page < key.pages); ++page) {
+    if (! bitmapGet(map, page))
+      continue;
+    if (! (slot % CACHE_CRC_CHUNK)) {
+      ok = f.seek(aviCacheTable(key) + slot * sizeof(crcs[0])) && (sdRead(crcs, sizeof(crcs)) > 0) &&
+        f.seek(aviCachePayload(key) + (uint32_t)slot * pageBytes);
+    }
+    if ((! ok) || (sdRead(pipe.page, pageBytes) != pageBytes) || (~crc32Update(CRC32_INIT, pipe.page, pageBytes) != crcs[slot % CACHE_CRC_CHUNK])) {
+      Serial.println(FPSTR(CACHE_ERROR));
+      ok = false;
+    } else {
+      pipe.pageAddr = (uint32_t)page * pageBytes;
+      if (! sink(pipe)) {
+        Serial.println(FPSTR(sink == queueFlashPage ? FLASH_WRITE_ERROR : FLASH_VERIFY_ERROR));
+        ok = false;
+      }
+    }
+    ++slot;
+    taskYield();
+  }
+  return ok;
+}
+
+static bool cachePageCrc(uint16_t slot, uint8_t *, uint32_t &crc) { // From the table, no page read through the buffer
+  return f.seek(cacheTable + slot * sizeof(crc)) && (sdRead(&crc, sizeof(crc)) == sizeof(crc));
+}
+
+static bool programFlashCache() {
+  aviheader_t header;
+  avicache_t key;
+#ifdef USE_HEAP
+  uint8_t *pages, *map;
+#else
+  uint8_t pages[FLASH_PAGE_SIZE_MAX * 2 * 2], map[FLASH_PAGES_MAX / 8];
+#endif
+  uint16_t pageBytes = ispFlashPageBytes();
+  flashpipe_t pipe;
+  bool ok = false;
+
+  if (! readCacheKey(header, key)) {
+    Serial.println(FPSTR(CACHE_ERROR));
+    return false;
+  }
 #ifdef USE_HEAP
+  pages = new uint8_t[pageBytes * 2];
+  if (pages) {
+    map = new uint8_t[key.pages / 8];
+    if (map) {
+#endif
+      ok = sdRead(map, key.pages / 8) == key.pages / 8;
+      if (! ok)
+        Serial.println(FPSTR(CACHE_ERROR));
+#ifndef ISP_GANG
+      cacheTable = aviCacheTable(key);
+      if (ok)
+        flashCurrent = targetFlashCurrent(map, cachePageCrc, pages);
+#endif
+      if (ok && (! flashCurrent)) {
+        ok = ispChipErase();
+        if (! ok)
+          Serial.println(FPSTR(CHIP_ERASE_ERROR));
+      }
+      beginFlashPipe(pipe, pages);
+      if (ok && (! flashCurrent))
+        ok = streamFlashCache(pipe, key, map, queueFlashPage);
+      if (ok && (! finishFlashPage(pipe))) {
+        Serial.println(FPSTR(FLASH_WRITE_ERROR));
+        ok = false;
       }
-      delete[] page;
+      if (ok && (! flashCurrent) && (VERIFY_POLICY == VERIFY_DEFERRED)) {
+        verifypass_t pass;
+
+        beginVerifyPass(pass);
+        ok = streamFlashCache(pipe, key, map, verifyFlashPage);
+        endVerifyPass(pass);
+      }
+#ifdef USE_HEAP
+      delete[] map;
     }
+    delete[] pages;
+  }
 #endif
-    f.close();
+  return ok;
+}
+#endif
+
+static bool programFlash(PGM_P fileName) {
+  char name[13];
+  bool result = false;
+
+  flashCurrent = false;
+  flashSaved = 0;
+  strcpy_P(name, fileName);
+  f = sdOpen(name, O_READ);
+  if (f) {
+    flashSource = SOURCE_HEX;
+#ifdef USE_AVI
+    if (f.peek() != ':')
+      result = programFlashImage();
+    else
+#endif
+#ifdef USE_CACHE
+    {
+      bool cached;
+
+      if (updateFlashCache(FIRMWARE_CACHE_NAME, cached)) {
+        if (cached) {
+          flashSource = SOURCE_CACHE;
+          f.close();
+          strcpy_P(name, FIRMWARE_CACHE_NAME);
+          f = sdOpen(name, O_READ);
+          result = f && programFlashCache();
+        } else
+          result = programFlashHex();
+      }
+    }
+#else
+      result = programFlashHex();
+#endif
+    if (f)
+      f.close();
   }
   return result;
 }
 
-void setup() {
-  Serial.begin(115200);
+static void printRunStats() {
+  phaseTime[PHASE_ISP_LOAD] = ispLoadTime;
+  phaseTime[PHASE_ISP_BUSY] = ispWaitTime;
+  phaseTime[PHASE_VERIFY] = ispVerifyTime;
+  Serial.print(F("Run time: "));
+  Serial.print(runTime);
+  Serial.println(F(" ms"));
+  for (uint8_t i = 0; i < PHASES; ++i) {
+    Serial.print(F("  "));
+    Serial.print(FPSTR(PHASE_NAMES[i]));
+    if (i == PHASE_VERIFY) {
+      Serial.print(F(" ("));
+      Serial.print(FPSTR(VERIFY_NAMES[VERIFY_POLICY]));
+      Serial.print(')');
+    }
+    Serial.print(F(": "));
+    Serial.print(phaseTime[i] / 1000);
+    Serial.println(F(" ms"));
+  }
+}
 
-  pinMode(BTN_PIN, INPUT_PULLUP);
-  pinMode(LED1_PIN, OUTPUT);
-  pinMode(LED2_PIN, OUTPUT);
-  digitalWrite(LED1_PIN, ! LED_LEVEL);
-  digitalWrite(LED2_PIN, ! LED_LEVEL);
+static bool logRun() { // Appends a runlog.csv row, after printRunStats()
+  char name[13];
 
-  if (! SD.begin(1000000, SD_PIN)) {
-    Serial.println(F("No SD card found!"));
-    error = true;
+  strcpy_P(name, RUNLOG_NAME);
+  f = sdOpen(name, O_WRITE | O_CREAT | O_APPEND);
+  if (f) {
+    if (! f.size())
+      f.println(FPSTR(RUNLOG_HEADER));
+    f.print(runTime);
+    f.print(error ? F(",FAIL,") : F(",OK,"));
+    if (ispDevice.name)
+      f.print(FPSTR(ispDevice.name));
+    f.print(',');
+    f.print(ispClockKHz());
+    for (uint8_t i = 0; i < PHASES; ++i) {
+      f.print(',');
+      f.print(phaseTime[i]);
+    }
+    f.print(',');
+    if (unitNumbered)
+      f.print(unitNumber, HEX);
+    f.print(',');
+    f.print(FPSTR(VERIFY_NAMES[VERIFY_POLICY]));
+    f.print(',');
+    f.print(flashCurrent ? flashSaved / 1000 : 0);
+    f.print(',');
+    f.print(sdClock);
+    f.print(',');
+    f.println(FPSTR(SOURCE_NAMES[flashSource]));
+    f.close();
+    return true;
+  }
+  return false;
+}
+
+/*
+ * The flow runs from loop(): FLOW_WAIT until the button is clicked or a task
+ * asks for a run, FLOW_BURN while burnTarget() runs, FLOW_RESULT until the
+ * LED pattern has shown the result. The wait tasks only act in FLOW_WAIT.
+ */
+enum flow_t : uint8_t { FLOW_WAIT, FLOW_BURN, FLOW_RESULT };
+
+static flow_t flow = FLOW_RESULT;
+static bool startRequested = false;
+
+/*
+ * LED patterns, drawn by ledTick() from the Timer0 compare B interrupt so
+ * they keep going through blocking SD and Serial calls. LED_RESULT shows the
+ * gang slots and the run result once, then turns to LED_OFF.
+ */
+enum ledpattern_t : uint8_t { LED_OFF, LED_WAIT, LED_BUSY, LED_RESULT };
+
+static volatile ledpattern_t ledPattern = LED_OFF;
+static volatile uint16_t ledTime; // Ticks of about 1 ms in the pattern
+
+static void ledTick() {
+  uint16_t t = ledTime++;
+  bool led1 = false, led2 = false;
+
+  if (ledPattern == LED_OFF) // Both were turned off when it was set
     return;
+  switch (ledPattern) {
+    case LED_WAIT:
+      led2 = t % 1000 < BLINK_TIME;
+      break;
+    case LED_BUSY:
+      led2 = t % 500 < BLINK_TIME;
+      break;
+    case LED_RESULT:
+#ifdef ISP_GANG
+      if (t < ISP_GANG * SLOT_TIME) { // One blink per slot in order, LED2 if it passed, LED1 if not
+        if (t % SLOT_TIME < SLOT_TIME / 2) {
+          if (ispSlots & (1 << (t / SLOT_TIME)))
+            led2 = true;
+          else
+            led1 = true;
+        }
+        break;
+      }
+      t -= ISP_GANG * SLOT_TIME;
+#endif
+      if (t < RESULT_TIME) {
+        led1 = error;
+        led2 = ! error;
+      } else
+        ledPattern = LED_OFF;
+      break;
+    default:
+      break;
   }
+  digitalWrite(LED1_PIN, LED_LEVEL == led1);
+  digitalWrite(LED2_PIN, LED_LEVEL == led2);
+}
 
-  ispInit();
+static void ledSet(ledpattern_t pattern) {
+  noInterrupts();
+  ledPattern = pattern;
+  ledTime = 0;
+  interrupts();
+  if (pattern == LED_OFF) {
+    digitalWrite(LED1_PIN, ! LED_LEVEL);
+    digitalWrite(LED2_PIN, ! LED_LEVEL);
+  }
+}
 
-  while (digitalRead(BTN_PIN)) { // Wait for button click
-    digitalWrite(LED2_PIN, LED_LEVEL == (millis() % 1000 < BLINK_TIME));
-    delay(10);
+#ifdef AUTO_START
+static uint8_t attachCount = 0; // Probes in a row disagreeing with attached
+static bool attached = false; // A target was seated and not removed since
+
+/*
+ * Probes the target every ATTACH_PERIOD while waiting. It is seated after
+ * ATTACH_CONFIRM probes in a row answered by every slot, and must be seen
+ * removed by as many probes answered by none before the next one counts.
+ */
+static void attachTask() {
+  uint8_t slots;
+
+  if (flow != FLOW_WAIT)
+    return;
+  slots = ispProbe();
+  if (attached ? ! slots : slots == ISP_ALL_SLOTS) {
+    if (++attachCount >= ATTACH_CONFIRM) {
+      attached = ! attached;
+      attachCount = 0;
+      startRequested = startRequested || attached;
+    }
+  } else
+    attachCount = 0;
+}
+#endif
+
+#ifdef USE_UPLOAD
+static void serialTask() { // Upload sessions while waiting
+  if ((flow != FLOW_WAIT) || (! Serial.available()))
+    return;
+#ifdef PRODUCTION
+  if (uploadRun(115200)) { // New files, nothing known about them
+    hexScan.size = 0;
+#ifdef USE_CACHE
+    cacheSource.sourceSize = 0;
+#endif
   }
+#else
+  uploadRun(115200);
+#endif
+}
+#endif
+
+static void burnTarget() { // From the start to the run log
+  error = false;
+  unitNumbered = false;
+  flashCurrent = false;
+  flashSource = SOURCE_NONE;
+  lockPending = false;
+  ispDevice.name = nullptr;
+  memset(phaseTime, 0, sizeof(phaseTime));
+  ispLoadTime = ispWaitTime = ispVerifyTime = 0;
 
+  ledSet(LED_BUSY);
+  runStart = millis();
+  randomSeed(micros()); // Pages sampled by VERIFY_SAMPLED
+  ++runCount;
+#ifdef AUTO_START
+  attached = true; // Started by the button too, it must be removed first
+  attachCount = 0;
+#endif
+  ispInit();
+
+#ifdef USE_UPLOAD
+  if (uploadPending()) { // The file it is for may be partial
+    Serial.println(F("Upload commit pending, reset to complete it!"));
+    error = true;
+  } else
+#endif
   if (ispBegin()) {
     uint8_t sign[3];
+    PGM_P source;
 
     ispReadSignature(sign);
     Serial.print(F("AVR signature: "));
@@ -634,38 +2098,96 @@ void setup() {
       Serial.print(sign[i], HEX);
     }
     Serial.println();
-    if ((sign[0] == 0x1E) && (sign[1] == 0x95) && ((sign[2] == 0x0F) || (sign[2] == 0x14))) {
+    printIspClock();
+    if (ispFindDevice(sign)) {
+      Serial.print(F("Device: "));
+      Serial.println(FPSTR(ispDevice.name));
+#ifdef PRODUCTION
+      if (runCount == 1) { // Backups of the first target only, the next ones would overwrite them
+#endif
       Serial.print(F("Dump fuses: "));
       Serial.println(FPSTR(FAIL_OR_OK[dumpFuses(FUSES_BACKUP_NAME)]));
       Serial.print(F("Dump EEPROM: "));
+#ifdef DUMP_BIN
+      if (! dumpEeprom(EEPROM_BACKUP_NAME, EEPROM_BIN_BACKUP_NAME))
+#else
       if (! dumpEeprom(EEPROM_BACKUP_NAME))
+#endif
         Serial.println(FPSTR(FAIL_OR_OK[0]));
       Serial.print(F("Dump flash: "));
+#ifdef DUMP_BIN
+      if (! dumpFlash(FIRMWARE_BACKUP_NAME, FIRMWARE_BIN_BACKUP_NAME))
+#else
       if (! dumpFlash(FIRMWARE_BACKUP_NAME))
+#endif
         Serial.println(FPSTR(FAIL_OR_OK[0]));
+#ifdef PRODUCTION
+      }
+#endif
 
-      if (fexists(FIRMWARE_NAME)) {
+      source = sourceName(FIRMWARE_NAME, FIRMWARE_IMAGE_NAME);
+      if ((! error) && source) {
         Serial.print(F("Flash burning... "));
-        if (programFlash(FIRMWARE_NAME)) {
-          Serial.println(FPSTR(FAIL_OR_OK[1]));
+        if (programFlash(source)) {
+          if (flashCurrent) {
+            Serial.print(FPSTR(ALREADY_CURRENT));
+            Serial.print(F(", ~"));
+            Serial.print(flashSaved / 1000);
+            Serial.println(F(" ms saved"));
+          } else
+            Serial.println(FPSTR(FAIL_OR_OK[1]));
+          if ((source == FIRMWARE_NAME) || (flashSource == SOURCE_LZ))
+            printHexStats();
         } else {
           Serial.println(FPSTR(FAIL_OR_OK[0]));
           error = true;
         }
       }
-      if ((! error) && fexists(EEPROM_NAME)) {
+      source = sourceName(EEPROM_NAME, EEPROM_IMAGE_NAME);
+      if ((! error) && source) {
         Serial.print(F("EEPROM burning... "));
-        if (programEeprom(EEPROM_NAME))
+        if (programEeprom(source))
+          Serial.println(FPSTR(eepromCurrent ? ALREADY_CURRENT : FAIL_OR_OK[1]));
+        else {
+          Serial.println(FPSTR(FAIL_OR_OK[0]));
+          error = true;
+        }
+      }
+      if ((! error) && fexists(SERIAL_NAME)) {
+        Serial.print(F("Serialization... "));
+#ifdef ISP_GANG
+        Serial.println(F("\r\nNot possible in gang mode!")); // EEPROM writes are broadcast
+        error = true;
+#else
+        if (programSerial(SERIAL_NAME))
           Serial.println(FPSTR(FAIL_OR_OK[1]));
         else {
           Serial.println(FPSTR(FAIL_OR_OK[0]));
           error = true;
         }
+        if (unitNumbered) {
+          Serial.print(F("Unit number: "));
+          Serial.println(unitNumber, HEX);
+        }
+#endif
       }
-      if ((! error) && fexists(FUSES_NAME)) {
+      if ((! error) && fexists(FUSES_NAME)) { // After the firmware is in place, a new clock source resyncs for the lock bits
+        ispclock_t clock = ispClock;
+
         Serial.print(F("Fuses burning... "));
-        if (programFuses(FUSES_NAME))
-          Serial.println(FPSTR(FAIL_OR_OK[1]));
+        if (programFuses(FUSES_NAME)) {
+          Serial.println(FPSTR(fusesCurrent ? ALREADY_CURRENT : FAIL_OR_OK[1]));
+          if (ispClock != clock)
+            printIspClock();
+        } else {
+          Serial.println(FPSTR(FAIL_OR_OK[0]));
+          error = true;
+        }
+      }
+      if ((! error) && lockPending) {
+        Serial.print(F("Lock bits burning... "));
+        if (programLock())
+          Serial.println(FPSTR(lockCurrent ? ALREADY_CURRENT : FAIL_OR_OK[1]));
         else {
           Serial.println(FPSTR(FAIL_OR_OK[0]));
           error = true;
@@ -679,21 +2201,103 @@ void setup() {
     Serial.println(F("AVR ISP init fail!"));
     error = true;
   }
+#ifdef ISP_GANG
+  if (error) // Nothing is known to be burned
+    ispDrop(ISP_ALL_SLOTS);
+  printSlots();
+  error = ispSlots != ISP_ALL_SLOTS;
+#endif
   ispDone();
+  runTime = millis() - runStart;
+  printRunStats();
+  if (! logRun())
+    Serial.println(F("Run log write error!"));
 }
 
-void loop() {
-  digitalWrite(LED1_PIN, LED_LEVEL == error);
-  digitalWrite(LED2_PIN, LED_LEVEL == (! error));
-  delay(1000);
+void setup() {
+  Serial.begin(115200);
+
+  pinMode(BTN_PIN, INPUT_PULLUP);
+  pinMode(LED1_PIN, OUTPUT);
+  pinMode(LED2_PIN, OUTPUT);
   digitalWrite(LED1_PIN, ! LED_LEVEL);
   digitalWrite(LED2_PIN, ! LED_LEVEL);
-//  Serial.flush();
-  SD.end();
-  SPI.end();
-  set_sleep_mode(SLEEP_MODE_PWR_DOWN);
-  sleep_enable();
-  sleep_bod_disable();
-  cli();
-  sleep_cpu();
+
+#ifdef USE_STK
+  delay(10); // Pullup settling
+  if (! digitalRead(BTN_PIN)) {
+    digitalWrite(LED2_PIN, LED_LEVEL);
+    stkRun();
+  }
+#endif
+
+  tasksBegin(ledTick);
+  ispIdle = taskYield;
+#ifdef AUTO_START
+  taskAdd(attachTask, ATTACH_PERIOD);
+#endif
+#ifdef USE_UPLOAD
+  taskAdd(serialTask, 10);
+#endif
+
+  if (! sdBegin(SD_PIN)) {
+    Serial.println(F("No SD card found!"));
+    error = true;
+    ledSet(LED_RESULT);
+    return;
+  }
+  Serial.print(F("SD clock: "));
+  Serial.print(sdClock);
+  Serial.println(F(" MHz"));
+#ifdef USE_UPLOAD
+  int8_t recovered = uploadRecover(); // -1 without a commit to complete
+
+  if (recovered >= 0) {
+    Serial.print(F("Upload commit: "));
+    Serial.println(FPSTR(FAIL_OR_OK[recovered]));
+  }
+#endif
+  flow = FLOW_WAIT;
+  ledSet(LED_WAIT);
+}
+
+void yield() { // Called by delay()
+  taskYield();
+}
+
+void loop() {
+  taskYield();
+  switch (flow) {
+    case FLOW_WAIT:
+      if (startRequested || (! digitalRead(BTN_PIN))) {
+        startRequested = false;
+        flow = FLOW_BURN;
+        burnTarget();
+        flow = FLOW_RESULT;
+        ledSet(LED_RESULT);
+      }
+      break;
+    case FLOW_RESULT:
+      if (ledPattern != LED_OFF) // Still showing it
+        break;
+#ifdef PRODUCTION
+      if (runCount) { // SD is mounted
+        flow = FLOW_WAIT;
+        ledSet(LED_WAIT);
+        break;
+      }
+#endif
+//      Serial.flush();
+      tasksEnd();
+      SD.end();
+      SPI.end();
+      set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+      sleep_enable();
+      sleep_bod_disable();
+      cli();
+      sleep_cpu();
+      break;
+    default:
+      break;
+  }
 }
@@ -0,0 +1,319 @@
+#pragma once
+
+#include <Arduino.h>
+#include "isp.h"
+
+/*
+ * STK500v2 programmer on Serial, for avrdude -c stk500v2. The host waits for
+ * the answer to each message before sending the next one, so messages are
+ * read and answered one at a time from a single buffer. Programming mode is
+ * entered with the isp.h clock ladder, the timing parameters of the host are
+ * ignored, and the target must be in ISP_DEVICES for memory commands.
+ */
+
+constexpr uint32_t STK_BAUD = 1000000; // Exact at F_CPU = 16 MHz, avrdude -b 1000000
+constexpr uint16_t STK_BODY_MAX = 275; // Buffer size of the STK500v2 firmware, holds PROGRAM_FLASH_ISP of a 256 bytes page
+constexpr uint32_t STK_TIMEOUT = 200; // 200 ms. between the bytes of a message
+
+constexpr uint8_t STK_MESSAGE_START = 0x1B;
+constexpr uint8_t STK_TOKEN = 0x0E;
+
+enum stkcmd_t : uint8_t {
+  STK_CMD_SIGN_ON = 0x01, STK_CMD_SET_PARAMETER = 0x02, STK_CMD_GET_PARAMETER = 0x03, STK_CMD_OSCCAL = 0x05, STK_CMD_LOAD_ADDRESS = 0x06,
+  STK_CMD_ENTER_PROGMODE_ISP = 0x10, STK_CMD_LEAVE_PROGMODE_ISP = 0x11, STK_CMD_CHIP_ERASE_ISP = 0x12,
+  STK_CMD_PROGRAM_FLASH_ISP = 0x13, STK_CMD_READ_FLASH_ISP = 0x14, STK_CMD_PROGRAM_EEPROM_ISP = 0x15, STK_CMD_READ_EEPROM_ISP = 0x16,
+  STK_CMD_PROGRAM_FUSE_ISP = 0x17, STK_CMD_READ_FUSE_ISP = 0x18, STK_CMD_PROGRAM_LOCK_ISP = 0x19, STK_CMD_READ_LOCK_ISP = 0x1A,
+  STK_CMD_READ_SIGNATURE_ISP = 0x1B, STK_CMD_READ_OSCCAL_ISP = 0x1C, STK_CMD_SPI_MULTI = 0x1D,
+  STK_ANSWER_CKSUM_ERROR = 0xB0
+};
+
+enum stkstatus_t : uint8_t { STK_STATUS_CMD_OK = 0x00, STK_STATUS_CMD_FAILED = 0xC0, STK_STATUS_CKSUM_ERROR = 0xC1, STK_STATUS_CMD_UNKNOWN = 0xC9 };
+
+constexpr uint8_t STK_PARAM_BUILD_NUMBER_LOW = 0x80;
+constexpr uint8_t STK_PARAM_BUILD_NUMBER_HIGH = 0x81;
+constexpr uint8_t STK_PARAM_HW_VER = 0x90;
+constexpr uint8_t STK_PARAM_SW_MAJOR = 0x91;
+constexpr uint8_t STK_PARAM_SW_MINOR = 0x92;
+constexpr uint8_t STK_PARAM_VTARGET = 0x94;
+
+static const char STK_SIGNATURE[] PROGMEM = "AVRISP_2";
+
+static uint8_t stkParams[16]; // Set by the host, 0x90..0x9F
+static uint32_t stkAddr; // From LOAD_ADDRESS, words for flash and bytes for EEPROM
+static bool stkProgMode = false;
+
+static int16_t stkRead() { // -1 on timeout
+  uint32_t start = millis();
+
+  while (! Serial.available()) {
+    if (millis() - start >= STK_TIMEOUT)
+      return -1;
+  }
+  return Serial.read();
+}
+
+/*
+ * Body length of the next valid message, 0 after a timeout or an oversized
+ * message, STK_BODY_MAX + 1 if the checksum is wrong.
+ */
+static uint16_t stkReceive(uint8_t *body, uint8_t &seq) {
+  int16_t c;
+  uint16_t size;
+  uint8_t sum;
+
+  while (Serial.read() != STK_MESSAGE_START);
+  if ((c = stkRead()) < 0)
+    return 0;
+  seq = c;
+  sum = STK_MESSAGE_START ^ seq;
+  if ((c = stkRead()) < 0)
+    return 0;
+  size = c << 8;
+  if ((c = stkRead()) < 0)
+    return 0;
+  size |= c;
+  sum ^= (size >> 8) ^ size;
+  if ((stkRead() != STK_TOKEN) || (! size) || (size > STK_BODY_MAX))
+    return 0;
+  sum ^= STK_TOKEN;
+  for (uint16_t i = 0; i < size; ++i) {
+    if ((c = stkRead()) < 0)
+      return 0;
+    body[i] = c;
+    sum ^= c;
+  }
+  if ((c = stkRead()) < 0)
+    return 0;
+  return sum == c ? size : STK_BODY_MAX + 1;
+}
+
+static void stkSend(const uint8_t *body, uint8_t seq, uint16_t size) {
+  uint8_t head[5] = { STK_MESSAGE_START, seq, (uint8_t)(size >> 8), (uint8_t)size, STK_TOKEN };
+  uint8_t sum = 0;
+
+  for (uint8_t i = 0; i < sizeof(head); ++i) {
+    sum ^= head[i];
+  }
+  for (uint16_t i = 0; i < size; ++i) {
+    sum ^= body[i];
+  }
+  Serial.write(head, sizeof(head));
+  Serial.write(body, size);
+  Serial.write(sum);
+}
+
+static uint8_t stkUniversal(const uint8_t *cmd, uint8_t retAddr) { // Byte retAddr (1..4) of the answer
+  uint8_t result = 0;
+
+  for (uint8_t i = 0; i < 4; ++i) {
+    uint8_t in = ispTransfer(cmd[i]);
+
+    if (i + 1 == retAddr)
+      result = in;
+  }
+  return result;
+}
+
+static bool stkEnterProgMode() {
+  uint8_t sign[3];
+
+  ispInit();
+  if (! ispBegin())
+    return false;
+  ispReadSignature(sign);
+  if (! ispFindDevice(sign))
+    ispDevice.name = nullptr; // Only fuse, lock and signature commands then
+  return true;
+}
+
+/*
+ * PROGRAM_FLASH_ISP with whole aligned pages goes through ispWriteFlashPage(),
+ * anything else is loaded byte by byte and written if mode bit 7 asks for it.
+ * Word mode (mode bit 0 clear) is for devices without pages and is refused.
+ */
+static bool stkProgramFlash(const uint8_t *data, uint16_t size, uint8_t mode) {
+  uint32_t addr = stkAddr * 2;
+
+  if ((! ispDevice.name) || (! (mode & 0x01)))
+    return false;
+  if ((size == ispFlashPageBytes()) && (! (addr & (size - 1))) && (mode & 0x80)) {
+    if (! ispWriteFlashPage(addr, data))
+      return false;
+  } else {
+    for (uint16_t i = 0; i < size; ++i) {
+      ispCommand(0x40 + 0x08 * ((addr + i) & 0x01), 0x00, ((addr + i) / 2) & (ispDevice.flashPageSize - 1), data[i]);
+    }
+    if (mode & 0x80) {
+      ispCommitFlashPage(addr);
+      if (! ispWait(ISP_WAIT_FLASH))
+        return false;
+    }
+  }
+  stkAddr += size / 2;
+  return true;
+}
+
+static bool stkProgramEeprom(const uint8_t *data, uint16_t size, uint8_t mode) {
+  if (! ispDevice.name)
+    return false;
+  if ((mode & 0x01) && (size == ispDevice.eepromPageSize) && (! (stkAddr & (size - 1)))) {
+    if (! ispWriteEepromPage(stkAddr, data))
+      return false;
+  } else {
+    for (uint16_t i = 0; i < size; ++i) {
+      if (! ispWriteEeprom(stkAddr + i, data[i]))
+        return false;
+    }
+  }
+  stkAddr += size;
+  return true;
+}
+
+/*
+ * Handles the message in body and puts the answer there, returns its size.
+ */
+static uint16_t stkHandle(uint8_t *body, uint16_t size) {
+  uint8_t *answer = &body[1];
+  uint16_t len;
+
+  switch (body[0]) {
+    case STK_CMD_SIGN_ON:
+      answer[0] = STK_STATUS_CMD_OK;
+      answer[1] = sizeof(STK_SIGNATURE) - 1;
+      memcpy_P(&answer[2], STK_SIGNATURE, sizeof(STK_SIGNATURE) - 1);
+      return 3 + sizeof(STK_SIGNATURE) - 1;
+    case STK_CMD_SET_PARAMETER:
+      if ((body[1] & 0xF0) == 0x90)
+        stkParams[body[1] & 0x0F] = body[2];
+      answer[0] = STK_STATUS_CMD_OK;
+      return 2;
+    case STK_CMD_GET_PARAMETER:
+      switch (body[1]) {
+        case STK_PARAM_BUILD_NUMBER_LOW:
+        case STK_PARAM_BUILD_NUMBER_HIGH:
+          answer[1] = 0;
+          break;
+        case STK_PARAM_HW_VER:
+          answer[1] = 2;
+          break;
+        case STK_PARAM_SW_MAJOR:
+          answer[1] = 2;
+          break;
+        case STK_PARAM_SW_MINOR:
+          answer[1] = 10;
+          break;
+        case STK_PARAM_VTARGET:
+          answer[1] = 50; // 5.0 V
+          break;
+        default:
+          answer[1] = (body[1] & 0xF0) == 0x90 ? stkParams[body[1] & 0x0F] : 0;
+          break;
+      }
+      answer[0] = STK_STATUS_CMD_OK;
+      return 3;
+    case STK_CMD_OSCCAL:
+      answer[0] = STK_STATUS_CMD_OK;
+      return 2;
+    case STK_CMD_LOAD_ADDRESS: // Word address for flash, bit 31 asks for Load Extended Address, done by ispSetExtAddr()
+      stkAddr = ((uint32_t)body[1] << 24) | ((uint32_t)body[2] << 16) | ((uint32_t)body[3] << 8) | body[4];
+      stkAddr &= 0x7FFFFFFF;
+      answer[0] = STK_STATUS_CMD_OK;
+      return 2;
+    case STK_CMD_ENTER_PROGMODE_ISP:
+      stkProgMode = stkEnterProgMode();
+      answer[0] = stkProgMode ? STK_STATUS_CMD_OK : STK_STATUS_CMD_FAILED;
+      return 2;
+    case STK_CMD_LEAVE_PROGMODE_ISP:
+      if (stkProgMode)
+        ispDone();
+      stkProgMode = false;
+      answer[0] = STK_STATUS_CMD_OK;
+      return 2;
+    case STK_CMD_CHIP_ERASE_ISP:
+      answer[0] = stkProgMode && ispDevice.name && ispChipErase() ? STK_STATUS_CMD_OK : STK_STATUS_CMD_FAILED;
+      return 2;
+    case STK_CMD_PROGRAM_FLASH_ISP:
+    case STK_CMD_PROGRAM_EEPROM_ISP:
+      len = (body[1] << 8) | body[2];
+      if ((! stkProgMode) || (len + 10 > size))
+        answer[0] = STK_STATUS_CMD_FAILED;
+      else if (body[0] == STK_CMD_PROGRAM_FLASH_ISP)
+        answer[0] = stkProgramFlash(&body[10], len, body[3]) ? STK_STATUS_CMD_OK : STK_STATUS_CMD_FAILED;
+      else
+        answer[0] = stkProgramEeprom(&body[10], len, body[3]) ? STK_STATUS_CMD_OK : STK_STATUS_CMD_FAILED;
+      return 2;
+    case STK_CMD_READ_FLASH_ISP:
+    case STK_CMD_READ_EEPROM_ISP:
+      len = (body[1] << 8) | body[2];
+      if ((! stkProgMode) || (len + 3 > STK_BODY_MAX)) {
+        answer[0] = STK_STATUS_CMD_FAILED;
+        return 2;
+      }
+      for (uint16_t i = 0; i < len; ++i) {
+        if (body[0] == STK_CMD_READ_FLASH_ISP)
+          answer[1 + i] = ispReadFlash(stkAddr * 2 + i);
+        else
+          answer[1 + i] = ispReadEeprom(stkAddr + i);
+      }
+      stkAddr += body[0] == STK_CMD_READ_FLASH_ISP ? len / 2 : len;
+      answer[0] = STK_STATUS_CMD_OK;
+      answer[1 + len] = STK_STATUS_CMD_OK;
+      return len + 3;
+    case STK_CMD_PROGRAM_FUSE_ISP:
+    case STK_CMD_PROGRAM_LOCK_ISP:
+      if (stkProgMode) {
+        stkUniversal(&body[1], 0);
+        delay(5); // tWD_FUSE, not all devices can be polled here
+      }
+      answer[0] = stkProgMode ? STK_STATUS_CMD_OK : STK_STATUS_CMD_FAILED;
+      answer[1] = answer[0];
+      return 3;
+    case STK_CMD_READ_FUSE_ISP:
+    case STK_CMD_READ_LOCK_ISP:
+    case STK_CMD_READ_SIGNATURE_ISP:
+    case STK_CMD_READ_OSCCAL_ISP:
+      if (stkProgMode)
+        answer[1] = stkUniversal(&body[2], body[1]);
+      answer[0] = stkProgMode ? STK_STATUS_CMD_OK : STK_STATUS_CMD_FAILED;
+      answer[2] = answer[0];
+      return 4;
+    case STK_CMD_SPI_MULTI: { // NumTx, NumRx, RxStartAddr, TxData
+      uint8_t numTx = body[1], numRx = body[2], rxStart = body[3]; // The answer overwrites them, TxData is read ahead of it
+
+      if ((! stkProgMode) || (numTx + 4 > size) || (numRx + 3 > STK_BODY_MAX)) {
+        answer[0] = STK_STATUS_CMD_FAILED;
+        return 2;
+      }
+      len = 0;
+      for (uint16_t i = 0; (i < numTx) || (len < numRx); ++i) {
+        uint8_t in = ispTransfer(i < numTx ? body[4 + i] : 0x00);
+
+        if ((i >= rxStart) && (len < numRx))
+          answer[1 + len++] = in;
+      }
+      answer[0] = STK_STATUS_CMD_OK;
+      answer[1 + len] = STK_STATUS_CMD_OK;
+      return len + 3;
+    }
+    default:
+      answer[0] = STK_STATUS_CMD_UNKNOWN;
+      return 2;
+  }
+}
+
+static void stkRun() { // Never returns
+  uint8_t body[STK_BODY_MAX];
+  uint16_t size;
+  uint8_t seq;
+
+  Serial.begin(STK_BAUD);
+  for (;;) {
+    size = stkReceive(body, seq);
+    if (size > STK_BODY_MAX) {
+      body[0] = STK_ANSWER_CKSUM_ERROR;
+      body[1] = STK_STATUS_CKSUM_ERROR;
+      stkSend(body, seq, 2);
+    } else if (size)
+      stkSend(body, seq, stkHandle(body, size));
+  }
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <Arduino.h>
+#include <SPI.h>
+
+/*
+ * SD card backend, selected at build time: the Arduino SD library by default,
+ * SdFat with -DUSE_SDFAT (see platformio.ini). Both give SD, File and the
+ * O_ flags, open files with O_RDWR rather than O_READ | O_WRITE.
+ *
+ * SdFat owns the SPI bus (ISP is bit-banged on PORTC), so the card keeps a
+ * multi-block read or write open across sequential blocks. Whole aligned
+ * blocks, as hexBuffer moves them, go straight between the card and the
+ * buffer. Dumps are preallocated contiguous and trimmed when closed, and
+ * sdReplace() is a rename instead of a copy.
+ */
+#ifdef USE_SDFAT
+#include <SdFat.h>
+
+static SdFat SD;
+#else
+#include <SD.h>
+#endif
+
+constexpr uint8_t SD_CLOCKS[] = { F_CPU / 2000000, F_CPU / 4000000, F_CPU / 8000000, 1 }; // MHz, fastest first
+constexpr uint8_t SD_MOUNTS = 2; // In a row for a clock to be kept
+
+static uint8_t sdClock = 0; // MHz, 0 if no card
+
+static bool sdMount(uint8_t csPin, uint8_t mhz) {
+#ifdef USE_SDFAT
+  return SD.begin(SdSpiConfig(csPin, DEDICATED_SPI, SD_SCK_MHZ(mhz)));
+#else
+  return SD.begin((uint32_t)mhz * 1000000, csPin);
+#endif
+}
+
+/*
+ * Mounts the card at the fastest clock it takes SD_MOUNTS times in a row.
+ * Each mount reads and checks the partition and volume boot blocks.
+ */
+static bool sdBegin(uint8_t csPin) {
+  for (uint8_t i = 0; i < sizeof(SD_CLOCKS); ++i) {
+    uint8_t mounts = 0;
+
+    while ((mounts < SD_MOUNTS) && sdMount(csPin, SD_CLOCKS[i])) {
+      if (++mounts < SD_MOUNTS)
+        SD.end();
+    }
+    if (mounts == SD_MOUNTS) {
+      sdClock = SD_CLOCKS[i];
+      return true;
+    }
+    SD.end();
+  }
+  sdClock = 0;
+  return false;
+}
+
+static void sdReserve(File &file, uint32_t size) { // Of a new file, best effort
+#ifdef USE_SDFAT
+  file.preAllocate(size); // Fragmented cards keep the file as it is
+#else
+  (void)file;
+  (void)size;
+#endif
+}
+
+static bool sdTrim(File &file) { // At the end of what was written, before seeking back
+#ifdef USE_SDFAT
+  return file.truncate(file.position());
+#else
+  (void)file;
+  return true;
+#endif
+}
+
+static bool sdCopy(const char *from, const char *to, uint8_t *buf, uint16_t size) {
+  File src, dst;
+  int16_t len;
+  bool result;
+
+  src = SD.open(from, O_READ);
+  if (! src)
+    return false;
+  dst = SD.open(to, O_WRITE | O_CREAT | O_TRUNC);
+  result = dst;
+  while (result && ((len = src.read(buf, size)) > 0)) {
+    result = dst.write(buf, len) == (size_t)len;
+  }
+  if (dst)
+    dst.close();
+  src.close();
+  return result;
+}
+
+/*
+ * Puts from in place of to. With SdFat from is gone after it, the SD library
+ * has no rename, so from is copied through buf and left for the caller.
+ */
+static bool sdReplace(const char *from, const char *to, uint8_t *buf, uint16_t size) {
+#ifdef USE_SDFAT
+  (void)buf;
+  (void)size;
+  if (SD.exists(to) && (! SD.remove(to)))
+    return false;
+  return SD.rename(from, to);
+#else
+  return sdCopy(from, to, buf, size);
+#endif
+}
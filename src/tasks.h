@@ -0,0 +1,73 @@
+#pragma once
+
+#include <avr/interrupt.h>
+#include <Arduino.h>
+
+/*
+ * Cooperative tasks: short polled functions run every period ms from
+ * taskYield(). loop(), delay() (through yield()), the ISP busy waits and the
+ * long burn and dump loops call it. A task must not block: taskYield() does
+ * nothing while a task runs, so none is re-entered and a task calling delay()
+ * or waiting on Serial holds all the others until it returns.
+ *
+ * What must keep time through blocking SD and Serial calls runs from the
+ * tick hook instead, called by the Timer0 compare B interrupt: Timer0 already
+ * overflows every 1.024 ms for millis(), so no timer is taken from the sketch,
+ * only the PWM of pin 5 (OC0B).
+ */
+typedef void (*task_t)();
+
+struct taskslot_t {
+  task_t run;
+  uint16_t period; // ms
+  uint16_t last; // Low bits of millis() at the last run
+};
+
+constexpr uint8_t TASKS_MAX = 4;
+
+static taskslot_t tasks[TASKS_MAX];
+static uint8_t taskCount = 0;
+static bool taskRunning = false;
+static void (*volatile taskTick)() = nullptr;
+
+ISR(TIMER0_COMPB_vect) {
+  if (taskTick)
+    taskTick();
+}
+
+static void tasksBegin(void (*tick)()) {
+  taskTick = tick;
+  OCR0B = 0x80; // Halfway between two millis() updates
+  TIMSK0 |= (1 << OCIE0B);
+}
+
+static void tasksEnd() {
+  TIMSK0 &= ~(1 << OCIE0B);
+  taskTick = nullptr;
+}
+
+static bool taskAdd(task_t run, uint16_t period) {
+  if (taskCount >= TASKS_MAX)
+    return false;
+  tasks[taskCount].run = run;
+  tasks[taskCount].period = period;
+  tasks[taskCount].last = millis();
+  ++taskCount;
+  return true;
+}
+
+static void taskYield() {
+  uint16_t now;
+
+  if (taskRunning)
+    return;
+  taskRunning = true;
+  now = millis();
+  for (uint8_t i = 0; i < taskCount; ++i) {
+    if ((uint16_t)(now - tasks[i].last) >= tasks[i].period) {
+      tasks[i].last = now;
+      tasks[i].run();
+    }
+  }
+  taskRunning = false;
+}
@@ -0,0 +1,250 @@
+#pragma once
+
+#include <Arduino.h>
+#include "avi.h"
+#include "storage.h"
+
+/*
+ * File upload to the SD card over Serial, driven by tools/upload.py. The host
+ * sends UPLOAD_MAGIC at 115200 baud, the answer is the magic, the window in
+ * blocks and the baud rate used for the rest of the session. Frames, all
+ * little-endian and ending with the CRC32 of the bytes before it:
+ *
+ *   'O' size:4 crc:4 len:1 name:len  opens an upload of size bytes with the
+ *                                     CRC32 crc, name must be in UPLOAD_NAMES
+ *   'D' block:2 len:2 data:len        block of up to UPLOAD_BLOCK bytes
+ *   'C'                               checks and commits the upload
+ *   'Q'                               ends the session
+ *
+ * Each frame is answered with 'A' or 'N' and a block number, 0xFFFF for the
+ * others. 'N' asks to resend from that block. The card cannot take serial
+ * data while it is written, so blocks are acknowledged once they are on the
+ * card and the window is 1 block here.
+ *
+ * Data goes to UPLOAD_TMP_NAME. The commit writes the target name into
+ * UPLOAD_JOURNAL_NAME, then puts the upload in place of the target with
+ * sdReplace() and removes both files. A commit that fails there or is cut by
+ * a power loss keeps both, is answered 'N' and is completed by
+ * uploadRecover() at the next boot. With SdFat the replace is a rename and
+ * the target is either the old or the new file. The SD library copies over
+ * the target, which is partial until the commit completes: the session takes
+ * no other upload and nothing is burned while uploadPending().
+ */
+
+constexpr uint32_t UPLOAD_BAUD = 1000000; // Exact at F_CPU = 16 MHz
+constexpr uint16_t UPLOAD_BLOCK = 512; // One SD block
+constexpr uint8_t UPLOAD_WINDOW = 1;
+constexpr uint32_t UPLOAD_TIMEOUT = 1000; // 1 s. between bytes, the session ends after it
+constexpr uint16_t UPLOAD_NONE = 0xFFFF;
+
+static const char UPLOAD_MAGIC[] PROGMEM = "AVRUP";
+static const char UPLOAD_TMP_NAME[] PROGMEM = "upload.tmp";
+static const char UPLOAD_JOURNAL_NAME[] PROGMEM = "upload.jnl";
+static const char UPLOAD_NAMES[][13] PROGMEM = { "firmware.hex", "eeprom.hex", "fuses.txt", "firmware.avi", "eeprom.avi", "serial.txt" };
+
+static int16_t uploadRead() { // -1 on timeout
+  uint32_t start = millis();
+
+  while (! Serial.available()) {
+    if (millis() - start >= UPLOAD_TIMEOUT)
+      return -1;
+  }
+  return Serial.read();
+}
+
+static bool uploadReadBytes(uint8_t *buf, uint16_t size, uint32_t &crc) {
+  for (uint16_t i = 0; i < size; ++i) {
+    int16_t c = uploadRead();
+
+    if (c < 0)
+      return false;
+    buf[i] = c;
+  }
+  crc = crc32Update(crc, buf, size);
+  return true;
+}
+
+static bool uploadCheckCrc(uint32_t crc) { // Reads the CRC32 ending a frame
+  uint32_t sent, dummy = 0;
+
+  return uploadReadBytes((uint8_t*)&sent, sizeof(sent), dummy) && (sent == ~crc);
+}
+
+static void uploadAnswer(char answer, uint16_t block) {
+  Serial.write(answer);
+  Serial.write((uint8_t*)&block, sizeof(block));
+}
+
+static bool uploadPending() { // A commit is in the journal
+  char journal[13];
+
+  strcpy_P(journal, UPLOAD_JOURNAL_NAME);
+  return SD.exists(journal);
+}
+
+/*
+ * Puts the upload in place of name and removes it and the journal. False if
+ * the replace failed, both are then kept for the next try.
+ */
+static bool uploadComplete(const char *name, uint8_t *buf) {
+  char tmp[13], journal[13];
+
+  strcpy_P(tmp, UPLOAD_TMP_NAME);
+  if (name[0] && SD.exists(tmp) && (! sdReplace(tmp, name, buf, UPLOAD_BLOCK)))
+    return false;
+  strcpy_P(journal, UPLOAD_JOURNAL_NAME);
+  SD.remove(tmp);
+  SD.remove(journal);
+  return true;
+}
+
+/*
+ * Completes a commit found in the journal. Returns -1 if there was none, else
+ * whether it completed.
+ */
+static int8_t uploadRecover(uint8_t *buf) {
+  char journal[13], name[13];
+  File f;
+  int16_t len;
+
+  strcpy_P(journal, UPLOAD_JOURNAL_NAME);
+  f = SD.open(journal, O_READ);
+  if (! f)
+    return -1;
+  len = f.read(name, sizeof(name) - 1);
+  f.close();
+  name[len > 0 ? len : 0] = '\0'; // Cut before the name was written, nothing to replace
+  return uploadComplete(name, buf);
+}
+
+static bool uploadCommit(const char *name, uint8_t *buf) {
+  char journal[13];
+  File f;
+  bool result;
+
+  strcpy_P(journal, UPLOAD_JOURNAL_NAME);
+  f = SD.open(journal, O_WRITE | O_CREAT | O_TRUNC);
+  if (! f)
+    return false;
+  result = f.write((const uint8_t*)name, strlen(name)) == strlen(name);
+  f.close();
+  if (! result) { // The target is untouched
+    SD.remove(journal);
+    return false;
+  }
+  return uploadComplete(name, buf);
+}
+
+static int8_t uploadFindName(const char *name) {
+  for (uint8_t i = 0; i < sizeof(UPLOAD_NAMES) / sizeof(UPLOAD_NAMES[0]); ++i) {
+    if (! strcmp_P(name, UPLOAD_NAMES[i]))
+      return i;
+  }
+  return -1;
+}
+
+static void uploadDrain() { // Rest of a broken frame
+  uint32_t last = millis();
+
+  while (millis() - last < 5) {
+    if (Serial.available()) {
+      Serial.read();
+      last = millis();
+    }
+  }
+}
+
+/*
+ * Runs a session if the bytes waiting on Serial start with UPLOAD_MAGIC,
+ * returns the number of files committed. Serial is back at baud on return.
+ */
+static uint8_t uploadRun(uint32_t baud) {
+  uint8_t buf[UPLOAD_BLOCK];
+  char tmp[13], name[13];
+  File f;
+  uint32_t size = 0, fileCrc = 0, received = 0, dataCrc = CRC32_INIT, crc;
+  uint16_t block = 0, len;
+  int16_t c;
+  uint8_t cmd, committed = 0;
+
+  for (uint8_t i = 0; i < sizeof(UPLOAD_MAGIC) - 1; ++i) {
+    if (uploadRead() != (int16_t)pgm_read_byte(&UPLOAD_MAGIC[i]))
+      return 0;
+  }
+  strcpy_P((char*)buf, UPLOAD_MAGIC);
+  Serial.print((const char*)buf);
+  Serial.write(UPLOAD_WINDOW);
+  Serial.write((const uint8_t*)&UPLOAD_BAUD, sizeof(UPLOAD_BAUD));
+  Serial.flush();
+  Serial.begin(UPLOAD_BAUD);
+  strcpy_P(tmp, UPLOAD_TMP_NAME);
+  name[0] = '\0';
+  while ((c = uploadRead()) >= 0) {
+    cmd = c;
+    crc = crc32Update(CRC32_INIT, &cmd, 1); // Of the frame
+    if (cmd == 'O') {
+      uint8_t nameLen;
+
+      if (f)
+        f.close();
+      if (uploadReadBytes((uint8_t*)&size, sizeof(size), crc) && uploadReadBytes((uint8_t*)&fileCrc, sizeof(fileCrc), crc) &&
+        uploadReadBytes(&nameLen, sizeof(nameLen), crc) && (nameLen < sizeof(name)) && uploadReadBytes((uint8_t*)name, nameLen, crc) &&
+        uploadCheckCrc(crc)) {
+        name[nameLen] = '\0';
+        f = (uploadFindName(name) >= 0) && (! uploadPending()) ? SD.open(tmp, O_WRITE | O_CREAT | O_TRUNC) : File();
+      } else
+        uploadDrain();
+      if (! f)
+        name[0] = '\0';
+      block = 0;
+      received = 0;
+      dataCrc = CRC32_INIT;
+      uploadAnswer(f ? 'A' : 'N', UPLOAD_NONE);
+    } else if (cmd == 'D') {
+      uint16_t number;
+
+      if (uploadReadBytes((uint8_t*)&number, sizeof(number), crc) && uploadReadBytes((uint8_t*)&len, sizeof(len), crc) &&
+        (len <= UPLOAD_BLOCK) && uploadReadBytes(buf, len, crc) && uploadCheckCrc(crc) &&
+        f && (number == block) && (received + len <= size) && (f.write(buf, len) == len)) {
+        received += len;
+        dataCrc = crc32Update(dataCrc, buf, len);
+        uploadAnswer('A', block++);
+      } else {
+        uploadDrain();
+        uploadAnswer('N', block);
+      }
+    } else if (cmd == 'C') {
+      bool ok = uploadCheckCrc(crc);
+
+      if (f)
+        f.close();
+      ok = ok && name[0] && (received == size) && (~dataCrc == fileCrc) && uploadCommit(name, buf);
+      if (ok)
+        ++committed;
+      else if (! uploadPending()) // Else kept for uploadRecover()
+        SD.remove(tmp);
+      name[0] = '\0';
+      uploadAnswer(ok ? 'A' : 'N', UPLOAD_NONE);
+    } else if (cmd == 'Q') {
+      if (uploadCheckCrc(crc)) {
+        uploadAnswer('A', UPLOAD_NONE);
+        break;
+      }
+      uploadDrain();
+      uploadAnswer('N', UPLOAD_NONE);
+    }
+  }
+  if (f) {
+    f.close();
+    SD.remove(tmp);
+  }
+  Serial.flush();
+  Serial.begin(baud);
+  return committed;
+}
+
+static int8_t uploadRecover() { // At boot, once the card is mounted
+  uint8_t buf[UPLOAD_BLOCK];
+
+  return uploadRecover(buf);
+}
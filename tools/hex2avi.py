@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+"""Convert an Intel HEX file into an AVRizer AVI image (see src/avi.h)."""
+
+import argparse
+import os
+import struct
+import sys
+import zlib
+
+AVI_VERSION = 1
+AVI_MEMORIES = {'flash': 0, 'eeprom': 1}
+AVI_FLAG_LZ = 0x0001
+HEADER = struct.Struct('<3sB3sBIIHHI')
+LZ_WINDOW = 256
+LZ_MIN_MATCH = 3
+LZ_MAX_MATCH = LZ_MIN_MATCH + 255
+
+
+def read_hex(path):
+    data = {}
+    base = 0
+    with open(path) as f:
+        for number, line in enumerate(f, 1):
+            line = line.strip()
+            if not line:
+                continue
+            if not line.startswith(':'):
+                sys.exit('%s:%d: wrong start' % (path, number))
+            record = bytes.fromhex(line[1:])
+            if len(record) < 5 or len(record) != record[0] + 5 or sum(record) & 0xFF:
+                sys.exit('%s:%d: wrong record' % (path, number))
+            length, addr, kind = record[0], (record[1] << 8) | record[2], record[3]
+            payload = record[4:4 + length]
+            if kind == 0x00:
+                for i, b in enumerate(payload):
+                    data[base + addr + i] = b
+            elif kind == 0x01:
+                break
+            elif kind == 0x02:
+                base = int.from_bytes(payload, 'big') << 4
+            elif kind == 0x04:
+                base = int.from_bytes(payload, 'big') << 16
+    return data
+
+
+def lz_pack(data):
+    """LZSS payload of an AVI_FLAG_LZ image, as aviLzRead() in src/avi.h decodes it."""
+    out = bytearray()
+    chains = {}  # Positions of each 3 byte string, oldest first
+    flags_at = items = 0
+    pos = 0
+    while pos < len(data):
+        if not items:
+            flags_at = len(out)
+            out.append(0)
+        best_len = best_distance = 0
+        limit = min(LZ_MAX_MATCH, len(data) - pos)
+        for start in reversed(chains.get(data[pos:pos + LZ_MIN_MATCH], ())):
+            if pos - start > LZ_WINDOW:
+                break
+            length = 0
+            while length < limit and data[start + length] == data[pos + length]:
+                length += 1
+            if length > best_len:
+                best_len, best_distance = length, pos - start
+                if length == limit:
+                    break
+        if best_len >= LZ_MIN_MATCH:
+            out[flags_at] |= 1 << items
+            out += bytes((best_distance - 1, best_len - LZ_MIN_MATCH))
+        else:
+            best_len = 1
+            out.append(data[pos])
+        for i in range(pos, pos + best_len):
+            chains.setdefault(data[i:i + LZ_MIN_MATCH], []).append(i)
+        pos += best_len
+        items = (items + 1) % 8
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('input', help='Intel HEX file')
+    parser.add_argument('output', help='AVI image to write')
+    parser.add_argument('--signature', default='1E950F', help='target signature, 6 hex digits (default: %(default)s)')
+    parser.add_argument('--memory', choices=AVI_MEMORIES, default='flash')
+    parser.add_argument('--page-size', type=int, help='page size in bytes (default: 128 for flash, 4 for EEPROM)')
+    parser.add_argument('--lz', action='store_true', help='compress the payload, flash only')
+    args = parser.parse_args()
+
+    if args.lz and args.memory != 'flash':
+        parser.error('--lz is for flash images only')
+    page_size = args.page_size or (128 if args.memory == 'flash' else 4)
+    data = read_hex(args.input)
+    if not data:
+        sys.exit('%s: no data' % args.input)
+    base = min(data) // page_size * page_size
+    end = (max(data) // page_size + 1) * page_size
+    payload = bytes(data.get(addr, 0xFF) for addr in range(base, end))
+    header = HEADER.pack(b'AVI', AVI_VERSION, bytes.fromhex(args.signature), AVI_MEMORIES[args.memory],
+                         base, len(payload), page_size, AVI_FLAG_LZ if args.lz else 0, zlib.crc32(payload))
+    packed = lz_pack(payload) if args.lz else payload
+    with open(args.output, 'wb') as f:
+        f.write(header + packed)
+    if args.lz:
+        print('%s: %d bytes packed to %d (%.2f:1), HEX file %d bytes (%.2f:1)' % (
+            args.output, len(payload), len(packed), len(payload) / len(packed),
+            os.path.getsize(args.input), os.path.getsize(args.input) / (HEADER.size + len(packed))))
+
+
+if __name__ == '__main__':
+    main()
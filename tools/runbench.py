@@ -0,0 +1,58 @@
+#!/usr/bin/env python3
+"""Compare burn times by flash source from an AVRizer runlog.csv.
+
+Burn the same firmware a few times from each source, firmware.hex alone and
+then the image from hex2avi.py with and without --lz, with the runlog left on
+the card. Successful runs with the same device, ISP and SD clocks are averaged
+per source. The run total also holds target sync, dumps, fuses and
+serialization, so the speedup against HEX (sources 'hex' and 'cache') is of
+the burn: the sum of the phase columns the firmware logs for the flash.
+"""
+
+import argparse
+import collections
+import csv
+import sys
+
+COLUMNS = [('sd_open_us', 'SD open'), ('sd_read_us', 'SD read'), ('hex_parse_us', 'parse'), ('isp_load_us', 'ISP load'),
+           ('isp_busy_us', 'ISP busy'), ('verify_us', 'verify')]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('runlog', help='runlog.csv copied from the SD card')
+    parser.add_argument('--all', action='store_true', help='include runs with nothing burned (saved_ms > 0)')
+    args = parser.parse_args()
+
+    groups = collections.OrderedDict()
+    with open(args.runlog, newline='') as f:
+        for row in csv.DictReader(f):
+            if row.get('result') != 'OK' or not row.get('source'):
+                continue
+            if not args.all and int(row['saved_ms'] or 0):
+                continue
+            key = (row['device'], row['isp_khz'], row['sd_mhz'])
+            groups.setdefault(key, collections.OrderedDict()).setdefault(row['source'], []).append(row)
+    if not groups:
+        sys.exit('%s: no runs with a flash source' % args.runlog)
+
+    for (device, isp_khz, sd_mhz), sources in groups.items():
+        print('%s, ISP %s kHz, SD %s MHz, times in ms' % (device, isp_khz, sd_mhz))
+        print('  %-6s %4s %8s' % ('source', 'runs', 'run') + ''.join(' %9s' % name for _, name in COLUMNS) +
+              ' %9s  speedup' % 'burn')
+        burns = {}
+        for source, rows in sources.items():
+            burns[source] = sum(int(row[column]) for row in rows for column, _ in COLUMNS) / len(rows) / 1000
+        base = burns.get('hex', burns.get('cache'))
+        for source, rows in sources.items():
+            line = '  %-6s %4d %8.0f' % (source, len(rows), sum(int(row['ms']) for row in rows) / len(rows))
+            for column, _ in COLUMNS:
+                line += ' %9.0f' % (sum(int(row[column]) for row in rows) / len(rows) / 1000)
+            line += ' %9.0f' % burns[source]
+            if base and burns[source]:
+                line += '  %6.2fx' % (base / burns[source])
+            print(line)
+
+
+if __name__ == '__main__':
+    main()
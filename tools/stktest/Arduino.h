@@ -0,0 +1,38 @@
+#pragma once
+
+/*
+ * Just enough of the Arduino core to build src/stk.h and src/isp.h on the
+ * host with -DISP_HOST, see stkhost.cpp.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+
+#define F_CPU 16000000UL
+
+#define PC0 0
+#define PC1 1
+#define PC2 2
+#define PC3 3
+#define PC4 4
+#define PC5 5
+#define PD2 2
+
+extern uint8_t DDRC, PORTC, PINC, DDRD, PORTD, PIND;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+class HardwareSerial {
+public:
+  void begin(unsigned long baud);
+  int available();
+  int read();
+  size_t write(uint8_t c);
+  size_t write(const uint8_t *buf, size_t size);
+};
+
+extern HardwareSerial Serial;
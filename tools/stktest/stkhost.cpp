@@ -0,0 +1,95 @@
+/*
+ * src/stk.h built for the host, driven by test_stk.py over stdin and stdout.
+ * Every exchange starts with an opcode byte from this side:
+ *
+ *   'T' data   ISP byte to the target model, answered with the byte it shifts out
+ *   'W' data   Serial byte to the host
+ *   'R'        Serial byte wanted, answered with 0 if there is none, or 1 and the byte
+ *
+ * Time only moves when the sketch looks at it or waits, and by 1 ms on each
+ * Serial poll that finds nothing, so STK_TIMEOUT is reached by polling.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stk.h"
+
+uint8_t DDRC, PORTC, PINC, DDRD, PORTD, PIND;
+HardwareSerial Serial;
+
+static uint64_t now; // us
+static int pending = -1; // Serial byte read ahead by available()
+
+static uint8_t exchange(uint8_t op, int data) { // Reply byte, the test ending closes stdin
+  int c;
+
+  putchar(op);
+  if (data >= 0)
+    putchar(data);
+  if (op == 'W')
+    return 0;
+  fflush(stdout);
+  if ((c = getchar()) == EOF)
+    exit(0);
+  return c;
+}
+
+unsigned long micros() {
+  return now += 4;
+}
+
+unsigned long millis() {
+  return micros() / 1000;
+}
+
+void delay(unsigned long ms) {
+  now += ms * 1000;
+}
+
+void delayMicroseconds(unsigned int us) {
+  now += us;
+}
+
+uint8_t ispHostTransfer(uint8_t data) {
+  now += 8;
+  return exchange('T', data);
+}
+
+void HardwareSerial::begin(unsigned long baud) {
+}
+
+int HardwareSerial::available() {
+  if (pending < 0) {
+    if (exchange('R', -1)) {
+      if ((pending = getchar()) == EOF)
+        exit(0);
+    } else
+      now += 1000;
+  }
+  return pending >= 0;
+}
+
+int HardwareSerial::read() {
+  int c;
+
+  available();
+  c = pending;
+  pending = -1;
+  return c;
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+  exchange('W', c);
+  return 1;
+}
+
+size_t HardwareSerial::write(const uint8_t *buf, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    write(buf[i]);
+  }
+  return size;
+}
+
+int main() {
+  stkRun();
+}
@@ -0,0 +1,354 @@
+#!/usr/bin/env python3
+"""STK500v2 programmer (src/stk.h) against a model of the ISP target.
+
+Builds stkhost.cpp with the host C++ compiler ($CXX, c++ by default) and runs
+the sketch code over pipes: test messages go in as Serial bytes, ISP bytes
+come out to Target, which answers them like an ATmega328P or ATmega2560.
+
+    python3 tools/stktest/test_stk.py [-v]
+"""
+
+import collections
+import os
+import shutil
+import subprocess
+import tempfile
+import unittest
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SRC = os.path.join(HERE, '..', '..', 'src')
+
+MESSAGE_START = 0x1B
+TOKEN = 0x0E
+BODY_MAX = 275
+
+CMD_SIGN_ON = 0x01
+CMD_SET_PARAMETER = 0x02
+CMD_GET_PARAMETER = 0x03
+CMD_LOAD_ADDRESS = 0x06
+CMD_ENTER_PROGMODE_ISP = 0x10
+CMD_LEAVE_PROGMODE_ISP = 0x11
+CMD_CHIP_ERASE_ISP = 0x12
+CMD_PROGRAM_FLASH_ISP = 0x13
+CMD_READ_FLASH_ISP = 0x14
+CMD_PROGRAM_EEPROM_ISP = 0x15
+CMD_READ_EEPROM_ISP = 0x16
+CMD_READ_SIGNATURE_ISP = 0x1B
+CMD_SPI_MULTI = 0x1D
+ANSWER_CKSUM_ERROR = 0xB0
+
+STATUS_CMD_OK = 0x00
+STATUS_CMD_FAILED = 0xC0
+STATUS_CKSUM_ERROR = 0xC1
+
+# name: signature, flash pages, page words, EEPROM bytes, EEPROM page bytes
+DEVICES = {
+    'ATmega328P': (b'\x1e\x95\x0f', 256, 64, 1024, 4),
+    'ATmega2560': (b'\x1e\x98\x01', 1024, 128, 4096, 8),
+}
+
+
+class Target:
+    """ISP side of an AVR in programming mode, one 4 byte instruction at a time."""
+
+    BUSY_POLLS = 2  # RDY/BSY polls answered busy after each write
+
+    def __init__(self, device):
+        self.signature, pages, self.page_words, eeprom_size, self.eeprom_page = DEVICES[device]
+        self.flash = bytearray(b'\xff' * pages * self.page_words * 2)
+        self.eeprom = bytearray(b'\xff' * eeprom_size)
+        self.fuses = {(0x50, 0x00): 0x62, (0x58, 0x08): 0xD9, (0x50, 0x08): 0xFF, (0x58, 0x00): 0xFF}
+        self.page = {}
+        self.eeprom_buffer = {}
+        self.ext = 0
+        self.busy = 0
+        self.cmd = []
+
+    def transfer(self, data):
+        i = len(self.cmd)
+        out = self.cmd[i - 1] if i in (1, 2) else self.answer() if i == 3 else 0x00
+        self.cmd.append(data)
+        if len(self.cmd) == 4:
+            self.execute(*self.cmd)
+            self.cmd = []
+        return out
+
+    def word(self, hi, lo):
+        return (self.ext << 16) | (hi << 8) | lo
+
+    def answer(self):
+        c1, c2, c3 = self.cmd
+        if c1 == 0x30:
+            return self.signature[c3 & 0x03]
+        if (c1, c2) in self.fuses:
+            return self.fuses[(c1, c2)]
+        if c1 in (0x20, 0x28):
+            return self.flash[(self.word(c2, c3) * 2 + (c1 == 0x28)) % len(self.flash)]
+        if c1 == 0xA0:
+            return self.eeprom[((c2 << 8) | c3) % len(self.eeprom)]
+        if c1 == 0xF0:
+            self.busy = max(self.busy - 1, 0)
+            return 0x01 if self.busy else 0x00
+        return 0x00
+
+    def execute(self, c1, c2, c3, c4):
+        if (c1, c2) == (0xAC, 0x80):
+            self.flash[:] = b'\xff' * len(self.flash)
+            self.fuses[(0x58, 0x00)] = 0xFF
+            self.busy = self.BUSY_POLLS + 1
+        elif c1 == 0x4D:
+            self.ext = c3
+        elif c1 in (0x40, 0x48):
+            self.page[(c3 % self.page_words) * 2 + (c1 == 0x48)] = c4
+        elif c1 == 0x4C:
+            base = (self.word(c2, c3) & ~(self.page_words - 1)) * 2
+            for offset, data in self.page.items():
+                self.flash[base + offset] &= data  # Programming only clears bits
+            self.page = {}
+            self.busy = self.BUSY_POLLS + 1
+        elif c1 == 0xC0:
+            self.eeprom[((c2 << 8) | c3) % len(self.eeprom)] = c4
+            self.busy = self.BUSY_POLLS + 1
+        elif c1 == 0xC1:
+            self.eeprom_buffer[c3 % self.eeprom_page] = c4
+        elif c1 == 0xC2:
+            base = ((c2 << 8) | c3) & ~(self.eeprom_page - 1)
+            for offset, data in self.eeprom_buffer.items():
+                self.eeprom[base + offset] = data
+            self.eeprom_buffer = {}
+            self.busy = self.BUSY_POLLS + 1
+
+
+def frame(seq, body):
+    message = bytes([MESSAGE_START, seq, len(body) >> 8, len(body) & 0xFF, TOKEN]) + bytes(body)
+    checksum = 0
+    for c in message:
+        checksum ^= c
+    return message + bytes([checksum])
+
+
+class Programmer:
+    """The sketch process: Serial in and out, ISP bytes to the target."""
+
+    def __init__(self, binary, target):
+        self.target = target
+        self.process = subprocess.Popen([binary], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        self.input = collections.deque()
+        self.output = bytearray()
+        self.reading = False  # The sketch waits for the answer to its 'R'
+        self.seq = 0
+
+    def close(self):
+        self.process.stdin.close()
+        self.process.wait()
+        self.process.stdout.close()
+
+    def reply(self, data):
+        self.process.stdin.write(bytes(data))
+        self.process.stdin.flush()
+
+    def run(self, idle_polls=0):
+        """Runs the sketch until it waits for Serial input with none left."""
+        while True:
+            if self.reading:
+                if self.input:
+                    self.reply([1, self.input.popleft()])
+                elif idle_polls:
+                    idle_polls -= 1
+                    self.reply([0])
+                else:
+                    return
+                self.reading = False
+            op = self.process.stdout.read(1)
+            if not op:
+                raise RuntimeError('stkhost exited')
+            if op == b'T':
+                self.reply([self.target.transfer(self.process.stdout.read(1)[0])])
+            elif op == b'W':
+                self.output += self.process.stdout.read(1)
+            elif op == b'R':
+                self.reading = True
+            else:
+                raise RuntimeError('stkhost sent %r' % op)
+
+    def answers(self):
+        messages = []
+        data = bytes(self.output)
+        self.output = bytearray()
+        while data:
+            if len(data) < 6 or data[0] != MESSAGE_START or data[4] != TOKEN:
+                raise AssertionError('bad framing: %s' % data.hex())
+            size = (data[2] << 8) | data[3]
+            checksum = 0
+            for c in data[:5 + size + 1]:
+                checksum ^= c
+            if checksum:
+                raise AssertionError('bad checksum: %s' % data.hex())
+            messages.append((data[1], data[5:5 + size]))
+            data = data[6 + size:]
+        return messages
+
+    def send_raw(self, data, idle_polls=0):
+        self.input.extend(data)
+        self.run(idle_polls)
+        return self.answers()
+
+    def command(self, *body):
+        """Sends one message, returns the body of its single answer."""
+        seq = self.seq
+        self.seq = (self.seq + 1) & 0xFF
+        answers = self.send_raw(frame(seq, body))
+        if len(answers) != 1 or answers[0][0] != seq:
+            raise AssertionError('answers to seq %d: %r' % (seq, answers))
+        return answers[0][1]
+
+
+class StkTest(unittest.TestCase):
+    device = 'ATmega328P'
+
+    @classmethod
+    def setUpClass(cls):
+        cls.build = tempfile.mkdtemp()
+        cls.binary = os.path.join(cls.build, 'stkhost')
+        subprocess.check_call([os.environ.get('CXX', 'c++'), '-std=gnu++11', '-DISP_HOST', '-I', HERE, '-I', SRC,
+                               os.path.join(HERE, 'stkhost.cpp'), '-o', cls.binary])
+
+    @classmethod
+    def tearDownClass(cls):
+        shutil.rmtree(cls.build)
+
+    def setUp(self):
+        self.target = Target(self.device)
+        self.stk = Programmer(self.binary, self.target)
+
+    def tearDown(self):
+        self.stk.close()
+
+    def assertOk(self, answer, cmd):
+        self.assertEqual(answer[:2], bytes([cmd, STATUS_CMD_OK]))
+
+    def enter(self):
+        self.assertOk(self.stk.command(CMD_ENTER_PROGMODE_ISP, 200, 100, 25, 32, 0, 0x53, 3, 0xAC, 0x53, 0, 0),
+                      CMD_ENTER_PROGMODE_ISP)
+
+    def load_address(self, addr):
+        self.assertOk(self.stk.command(CMD_LOAD_ADDRESS, *addr.to_bytes(4, 'big')), CMD_LOAD_ADDRESS)
+
+    def program_flash(self, data, mode=0xC1):
+        return self.stk.command(CMD_PROGRAM_FLASH_ISP, len(data) >> 8, len(data) & 0xFF, mode, 10, 0x40, 0x4C, 0x20,
+                                0, 0, *data)
+
+    def read_flash(self, size):
+        answer = self.stk.command(CMD_READ_FLASH_ISP, size >> 8, size & 0xFF, 0x20)
+        self.assertOk(answer, CMD_READ_FLASH_ISP)
+        self.assertEqual(answer[-1], STATUS_CMD_OK)
+        return answer[2:-1]
+
+
+class ProtocolTest(StkTest):
+    def test_sign_on(self):
+        self.assertEqual(self.stk.command(CMD_SIGN_ON), bytes([CMD_SIGN_ON, STATUS_CMD_OK, 8]) + b'AVRISP_2')
+
+    def test_parameters(self):
+        self.assertOk(self.stk.command(CMD_SET_PARAMETER, 0x98, 0x01), CMD_SET_PARAMETER)
+        self.assertEqual(self.stk.command(CMD_GET_PARAMETER, 0x98), bytes([CMD_GET_PARAMETER, STATUS_CMD_OK, 0x01]))
+        self.assertEqual(self.stk.command(CMD_GET_PARAMETER, 0x90), bytes([CMD_GET_PARAMETER, STATUS_CMD_OK, 2]))
+
+    def test_bad_checksum(self):
+        message = bytearray(frame(7, [CMD_SIGN_ON]))
+        message[-1] ^= 0xFF
+        self.assertEqual(self.stk.send_raw(message), [(7, bytes([ANSWER_CKSUM_ERROR, STATUS_CKSUM_ERROR]))])
+        self.assertEqual(self.stk.command(CMD_SIGN_ON)[1], STATUS_CMD_OK)
+
+    def test_oversized_message(self):
+        self.assertEqual(self.stk.send_raw(frame(3, [0x00] * (BODY_MAX + 1))), [])
+        self.assertEqual(self.stk.command(CMD_SIGN_ON)[1], STATUS_CMD_OK)
+
+    def test_timeout(self):
+        self.assertEqual(self.stk.send_raw(frame(3, [CMD_SIGN_ON])[:4], idle_polls=250), [])
+        self.assertEqual(self.stk.command(CMD_SIGN_ON)[1], STATUS_CMD_OK)
+
+    def test_needs_progmode(self):
+        self.assertEqual(self.program_flash(b'\x00' * 128), bytes([CMD_PROGRAM_FLASH_ISP, STATUS_CMD_FAILED]))
+
+    def test_signature(self):
+        self.enter()
+        for i in range(3):
+            answer = self.stk.command(CMD_READ_SIGNATURE_ISP, 4, 0x30, 0x00, i, 0x00)
+            self.assertEqual(answer, bytes([CMD_READ_SIGNATURE_ISP, STATUS_CMD_OK, self.target.signature[i],
+                                            STATUS_CMD_OK]))
+
+    def test_spi_multi(self):
+        self.enter()
+        answer = self.stk.command(CMD_SPI_MULTI, 4, 4, 0, 0x30, 0x00, 0x01, 0x00)
+        self.assertEqual(answer, bytes([CMD_SPI_MULTI, STATUS_CMD_OK, 0x00, 0x30, 0x00, self.target.signature[1],
+                                        STATUS_CMD_OK]))
+        answer = self.stk.command(CMD_SPI_MULTI, 3, 2, 2, 0x30, 0x00, 0x02)  # Clocks a 4th byte out
+        self.assertEqual(answer, bytes([CMD_SPI_MULTI, STATUS_CMD_OK, 0x00, self.target.signature[2], STATUS_CMD_OK]))
+
+    def test_flash_page(self):
+        self.enter()
+        self.assertOk(self.stk.command(CMD_CHIP_ERASE_ISP, 10, 0, 0xAC, 0x80, 0, 0), CMD_CHIP_ERASE_ISP)
+        page = bytes((i * 7 + 3) & 0xFF for i in range(128))
+        self.load_address(0x40)  # Words, second page
+        self.assertOk(self.program_flash(page), CMD_PROGRAM_FLASH_ISP)
+        self.assertEqual(bytes(self.target.flash[0x80:0x100]), page)
+        self.load_address(0x40)
+        self.assertEqual(self.read_flash(128), page)
+
+    def test_flash_bytes(self):
+        self.enter()
+        self.load_address(0x80)
+        self.assertOk(self.program_flash(b'\x12\x34\x56\x78', 0x81), CMD_PROGRAM_FLASH_ISP)
+        self.assertEqual(bytes(self.target.flash[0x100:0x104]), b'\x12\x34\x56\x78')
+
+    def test_eeprom(self):
+        self.enter()
+        self.load_address(8)
+        answer = self.stk.command(CMD_PROGRAM_EEPROM_ISP, 0, 4, 0xC1, 10, 0xC1, 0xC2, 0xA0, 0, 0, 1, 2, 3, 4)
+        self.assertOk(answer, CMD_PROGRAM_EEPROM_ISP)
+        self.load_address(13)
+        answer = self.stk.command(CMD_PROGRAM_EEPROM_ISP, 0, 2, 0x04, 10, 0xC0, 0, 0xA0, 0, 0, 0xAA, 0x55)
+        self.assertOk(answer, CMD_PROGRAM_EEPROM_ISP)
+        self.assertEqual(bytes(self.target.eeprom[8:16]), b'\x01\x02\x03\x04\xff\xaa\x55\xff')
+        self.load_address(8)
+        answer = self.stk.command(CMD_READ_EEPROM_ISP, 0, 8, 0xA0)
+        self.assertEqual(answer, bytes([CMD_READ_EEPROM_ISP, STATUS_CMD_OK]) + b'\x01\x02\x03\x04\xff\xaa\x55\xff' +
+                         bytes([STATUS_CMD_OK]))
+
+    def test_leave_progmode(self):
+        self.enter()
+        self.assertOk(self.stk.command(CMD_LEAVE_PROGMODE_ISP, 1, 1), CMD_LEAVE_PROGMODE_ISP)
+        self.assertEqual(self.stk.command(CMD_READ_FLASH_ISP, 0, 2, 0x20), bytes([CMD_READ_FLASH_ISP,
+                                                                                 STATUS_CMD_FAILED]))
+
+
+class Mega2560Test(StkTest):
+    device = 'ATmega2560'
+
+    def test_extended_address(self):
+        self.enter()
+        high = bytes((i * 5 + 1) & 0xFF for i in range(256))
+        low = bytes((i * 3 + 2) & 0xFF for i in range(256))
+        self.load_address(0x80000000 | 0x10000)  # Bit 31 asks for Load Extended Address, byte 0x20000
+        self.assertOk(self.program_flash(high), CMD_PROGRAM_FLASH_ISP)
+        self.assertEqual(self.target.ext, 1)
+        self.load_address(0x80000000 | 0x80)  # Back below 128 KB
+        self.assertOk(self.program_flash(low), CMD_PROGRAM_FLASH_ISP)
+        self.assertEqual(self.target.ext, 0)
+        self.assertEqual(bytes(self.target.flash[0x20000:0x20100]), high)
+        self.assertEqual(bytes(self.target.flash[0x100:0x200]), low)
+        self.load_address(0x80000000 | 0x10000)
+        self.assertEqual(self.read_flash(256), high)
+
+    def test_eeprom_page(self):
+        self.enter()
+        self.load_address(0x800)
+        data = bytes(range(0x10, 0x18))
+        answer = self.stk.command(CMD_PROGRAM_EEPROM_ISP, 0, 8, 0xC1, 10, 0xC1, 0xC2, 0xA0, 0, 0, *data)
+        self.assertOk(answer, CMD_PROGRAM_EEPROM_ISP)
+        self.assertEqual(bytes(self.target.eeprom[0x800:0x808]), data)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+"""Upload files to the AVRizer SD card over Serial (see src/upload.h)."""
+
+import argparse
+import os
+import struct
+import sys
+import time
+import zlib
+
+import serial
+
+MAGIC = b'AVRUP'
+BAUD = 115200
+BLOCK = 512
+RETRIES = 5
+NONE = 0xFFFF
+
+
+def frame(payload):
+    return payload + struct.pack('<I', zlib.crc32(payload))
+
+
+def answer(port):
+    data = port.read(3)
+    if len(data) != 3:
+        sys.exit('no answer')
+    return chr(data[0]), struct.unpack('<H', data[1:])[0]
+
+
+def open_session(port):
+    port.reset_input_buffer()
+    port.write(MAGIC)
+    reply = port.read(len(MAGIC) + 5)
+    if len(reply) != len(MAGIC) + 5 or reply[:len(MAGIC)] != MAGIC:
+        sys.exit('no AVRizer waiting for the button on %s' % port.port)
+    window, baud = struct.unpack('<BI', reply[len(MAGIC):])
+    time.sleep(0.01)
+    port.baudrate = baud
+    return window
+
+
+def send_file(port, window, path, name):
+    with open(path, 'rb') as f:
+        data = f.read()
+    blocks = [data[i:i + BLOCK] for i in range(0, len(data), BLOCK)]
+    for _ in range(RETRIES):
+        port.write(frame(b'O' + struct.pack('<IIB', len(data), zlib.crc32(data), len(name)) + name.encode()))
+        if answer(port)[0] == 'A':
+            break
+    else:
+        sys.exit('%s: refused, unknown name or a commit pending until the next reset' % name)
+    sent = acked = 0
+    errors = 0
+    while acked < len(blocks):
+        while sent < len(blocks) and sent - acked < window:
+            port.write(frame(b'D' + struct.pack('<HH', sent, len(blocks[sent])) + blocks[sent]))
+            sent += 1
+        kind, block = answer(port)
+        if kind == 'A' and block == acked:
+            acked += 1
+        else:
+            errors += 1
+            if errors > RETRIES * max(1, len(blocks)):
+                sys.exit('%s: too many errors' % name)
+            time.sleep(0.01)  # Lets the rest of the window drain
+            port.reset_input_buffer()
+            sent = acked = block if block != NONE else acked
+    port.write(frame(b'C'))
+    if answer(port)[0] != 'A':
+        sys.exit('%s: commit failed, if it got as far as the journal it completes at the next reset' % name)
+    return errors
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('port', help='serial port of the programmer')
+    parser.add_argument('files', nargs='+', help='files to upload, NAME=PATH stores PATH as NAME')
+    args = parser.parse_args()
+
+    port = serial.Serial(args.port, BAUD, timeout=2)
+    window = open_session(port)
+    for spec in args.files:
+        path = spec.split('=', 1)[-1]
+        name = spec.split('=', 1)[0] if '=' in spec else os.path.basename(path)
+        start = time.time()
+        errors = send_file(port, window, path, name)
+        elapsed = time.time() - start
+        print('%s: %d bytes in %.2f s, %d resent' % (name, os.path.getsize(path), elapsed, errors))
+    port.write(frame(b'Q'))
+    answer(port)
+
+
+if __name__ == '__main__':
+    main()